@@ -0,0 +1,54 @@
+#ifndef _BMAP_H_
+#define _BMAP_H_
+
+#include <stddef.h>
+
+struct inode;
+
+/* a file's block map, as in ext2: i_block[0..DIRECT_BLOCKS) point at data,
+ * i_block[IND_BLOCK / DIND_BLOCK / TIND_BLOCK] at blocks of int32 block
+ * numbers one, two and three levels above it; -1 means none.
+ * with INODE_EXTENTS, i_block holds (logical, start, length) extents
+ * instead, in place or in leaf blocks it points at (ext4 style); a
+ * build picks extents whenever the file's runs fit in them.
+ * an INODE_INLINE file has its bytes in i_block and maps no blocks */
+
+size_t bmap_max_blocks(void);       /* longest file the map can hold, in blocks */
+size_t bmap_map_blocks(size_t n);   /* indirect blocks a file of n blocks takes */
+
+int    bmap_get(const struct inode *inode, size_t idx);          /* block of file block idx, -1 if none */
+size_t bmap_list(const struct inode *inode, int *out, size_t n); /* the first n, stops at a hole */
+
+/* map exactly blks[0..n) into an inode with an empty map; on failure the
+ * map stays empty and blks are freed */
+int    bmap_build(struct inode *inode, const int *blks, size_t n);
+void   bmap_clear(struct inode *inode, int free_data); /* free the indirect blocks (and the data), map empty */
+
+/* the map swapped for one of exactly blks[0..n), e.g. after the data
+ * moved: the data blocks of the old map are the caller's to drop. on
+ * failure the old map is still there and blks are still the caller's */
+int    bmap_replace(struct inode *inode, const int *blks, size_t n);
+
+/* point file block idx at blk instead (a copy on write moved it); the
+ * old block is the caller's to drop. an extent splits round it in place,
+ * the map is only built again when there is no room for that */
+int    bmap_set(struct inode *inode, size_t idx, int blk);
+
+/* bmap_set for file blocks [idx, idx + n) in one go: an extent map edits
+ * the leaf once for the whole range. on failure nothing has moved */
+int    bmap_remap(struct inode *inode, size_t idx, const int *blks, size_t n);
+
+/* blks[0..n) mapped after the have blocks the file has: a block map
+ * fills in pointers (and indirect blocks as it needs them), an extent
+ * map grows its last extent or adds one. nothing is rebuilt unless the
+ * extents run out. on failure the blocks are the caller's again */
+int    bmap_append(struct inode *inode, size_t have, const int *blks, size_t n);
+
+/* every block of the map: data in file order, each indirect block after
+ * what it points at; a nonzero return stops the walk */
+typedef int (*bmap_fn)(int blkno, int is_map, void *arg);
+int    bmap_walk(const struct inode *inode, bmap_fn fn, void *arg);
+
+void   bmap_reset(void);            /* new mount: forget the cached map blocks */
+
+#endif /* _BMAP_H_ */
@@ -22,6 +22,15 @@
 /* mode bits done */
 
 #define DIRECT_BLOCKS 12
+#define IND_BLOCK     12  /* single indirect */
+#define DIND_BLOCK    13  /* double indirect */
+#define TIND_BLOCK    14  /* triple indirect */
+#define N_BLOCKS      15
+
+#define INODE_EXTENTS 0x1 /* i_block holds extents, not block pointers */
+#define INODE_INLINE  0x2 /* i_block holds the file bytes themselves */
+
+#define INLINE_DATA_MAX (N_BLOCKS * sizeof(int32_t)) /* bytes a file keeps in place */
 
 struct super_block;
 
@@ -41,7 +50,8 @@ struct inode {
   size_t          i_size;    /* file size in bytes */
   uint64_t        i_mtime;   /* epoch time */
 
-  int             i_block[DIRECT_BLOCKS]; /* direct blocks, -1 means none */
+  uint32_t        i_flags;   /* INODE_EXTENTS, INODE_INLINE */
+  int             i_block[N_BLOCKS]; /* block map, extents (bmap.h) or inline bytes; -1 means none */
 
   struct super_block *i_sb;
 };
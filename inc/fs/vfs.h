@@ -2,6 +2,7 @@
 #define _VFS_H_
 
 #include "super.h"
+#include "types.h"
 
 int fs_init(void);
 struct super_block *fs_get_super(void);
@@ -28,15 +29,29 @@ int vfs_vim(const char *path);
 
 void vfs_stat(const char *path);
 int vfs_cp(const char *src, const char *dest);
+int vfs_cp_reflink(const char *src, const char *dest); /* share the blocks, copy on write */
 
 int vfs_import(const char *host_path, const char *vfs_path);
 int vfs_export(const char *vfs_path, const char *host_path);
 
+/* open files: mode as fopen's (r, r+, w, w+; a, a+ append), permissions
+ * checked at open. reads and writes touch only the blocks they cover and
+ * an append only the tail block and new ones; counts are -1 on error */
 int vfs_open(const char *path, const char *mode);
 int vfs_close(int fd);
-size_t vfs_read(int fd, void *buf, size_t count);
-size_t vfs_write(int fd, const void *buf, size_t count);
+int64_t vfs_read(int fd, void *buf, size_t count);
+int64_t vfs_write(int fd, const void *buf, size_t count);
+int64_t vfs_pread(int fd, void *buf, size_t count, fs_off_t off);          /* at off, fd offset unchanged */
+int64_t vfs_pwrite(int fd, const void *buf, size_t count, fs_off_t off);
+fs_off_t vfs_lseek(int fd, fs_off_t off, int whence);                      /* SEEK_SET / SEEK_CUR / SEEK_END */
 
 void vfs_tree(const char *path);
 
+int vfs_frag(const char *path);    /* free extent sizes + files in several extents */
+int vfs_defrag(const char *path);  /* move fragmented files into contiguous runs */
+
+int vfs_sync(void);  /* checkpoint metadata + changed blocks to the image */
+int vfs_commit(void);         /* journal everything done since the last commit */
+int vfs_commit_due_in(void);  /* ms until the batch should commit, 0 now, -1 nothing to do */
+
 #endif /* _VFS_H_ */
@@ -1,75 +1,2414 @@
 /*standard lib */
+#ifndef _WIN32
+#define _DEFAULT_SOURCE /* mmap / MAP_ANONYMOUS / ftruncate */
+#define _GNU_SOURCE     /* fallocate */
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define IOQ_URING 1
+#endif
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CRC_SSE42 1
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 /*standard lib done*/
 
 #include "block.h"
+#include "lz.h"
 
+#define IMG_MAGIC_V1 0x56465331u /* 'VFS1': fixed 16-byte header, byte bitmap */
+#define IMG_MAGIC    0x56465332u /* 'VFS2' */
+#define IMG_VERSION  5           /* v1: byte bitmap, v2: packed 64-bit words, v3: + journal,
+                                    v4: + compressed length table, v5: + block checksums */
 
-/* RAM BLOCK Device (temp) */
-static uint8_t block_data[BLOCK_COUNT][BLOCK_SIZE];
-static uint8_t block_bitmap[BLOCK_COUNT]; /* 0 = free, 1 = used */
-/* RAM BLOCK Device (temp) */
+#define IMG_PAGE     4096u
+
+#define JRNL_MIN_BLOCKS 64
+#define JRNL_MAX_BLOCKS 16384
+
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t reserved;
+} img_hdr_v1_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t journal_blocks; /* v3: redo log right after the data blocks */
+    uint64_t block_count;
+    uint64_t bitmap_off;  /* byte offset of the allocation bitmap */
+    uint64_t data_off;    /* byte offset of block 0, page aligned */
+    uint64_t ctab_off;    /* v4: uint32 per block after the journal, 0 = none */
+    uint64_t csum_off;    /* v5: crc32c per block after the journal, 0 = none */
+} img_hdr_t;
+
+#define IMG_HDR_V3_SIZE offsetof(img_hdr_t, ctab_off)
+#define IMG_HDR_V4_SIZE offsetof(img_hdr_t, csum_off)
+
+/* device geometry, taken from the image header */
+typedef struct {
+    uint32_t version;
+    size_t   bsize;
+    uint64_t count;
+    size_t   bitmap_off;
+    size_t   data_off;
+    size_t   map_size;   /* header | bitmap | data blocks, what gets mapped */
+    size_t   journal_off; /* == map_size */
+    uint32_t journal_blocks; /* 0: no journal in this image */
+    size_t   csum_off;   /* block checksums, 0: none */
+    size_t   ctab_off;   /* compressed lengths, 0: blocks are stored raw */
+    size_t   img_size;   /* mapped part + journal + tables */
+    int      byte_bitmap; /* older layout, one byte per block */
+} img_geom_t;
+
+static img_geom_t g_geo;
+
+/* ---------- journal format ----------
+ * block 0 of the journal area holds jrnl_sb_t, the log starts at block 1.
+ * a transaction is a jtxn_hdr_t and `len` bytes of records; crc covers the
+ * records, so replay stops at a torn or stale transaction. one too big
+ * for the log goes past the end of the image instead, and JRNL_OVERFLOW
+ * in the superblock says it is there, after the log's own. */
+#define JRNL_MAGIC 0x4A524E4Cu /* 'JRNL' */
+#define JTXN_MAGIC 0x4A54584Eu /* 'JTXN' */
+#define JRNL_OVERFLOW 0x1u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;       /* JRNL_OVERFLOW; 0 in images from before it */
+    uint64_t seq;         /* first transaction the log may hold */
+} jrnl_sb_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;         /* crc32c of the records */
+    uint64_t seq;
+    uint64_t len;
+} jtxn_hdr_t;
+
+enum { JREC_BLOCK = 1, JREC_WORD = 2 };
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;         /* payload bytes that follow */
+    uint64_t where;       /* block number / bitmap word index */
+} jrec_t;
+
+#define JREC_BLOCK_COST (sizeof(jrec_t) + g_geo.bsize)
+#define JREC_WORD_COST  (sizeof(jrec_t) + sizeof(uint64_t))
+
+/* Block device: header, bitmap and data live in one mapping.
+ * file-backed (MAP_PRIVATE on disk.img) after block_load_image(), so
+ * changes only reach the file through the journal and checkpoints;
+ * anonymous until the first save on a fresh disk. */
+static uint8_t *img_base;
+static uint8_t *block_data;   /* count * bsize */
+static int      img_fd = -1;  /* -1 = not backed by a file */
+static char     img_path[256]; /* image saves go to by default */
+static int      img_current;   /* img_path has this layout, saves can be incremental */
+
+static void img_set_path(const char *filename, int current)
+{
+    strncpy(img_path, filename, sizeof(img_path) - 1);
+    img_path[sizeof(img_path) - 1] = '\0';
+    img_current = current;
+}
+
+/* bounded-memory mode: data blocks go through a buffer cache over the
+ * image file instead of the mapping (see block_set_cache) */
+static size_t   cache_want;  /* buffers to use from the next load on, 0 = map */
+static size_t   cache_n;     /* buffers in use, 0 = blocks are mapped */
+static uint8_t *cache_get(uint64_t b, int fill);
+static void     cache_pin(uint64_t b, int wr);
+static int      cache_read_run(uint64_t b, uint64_t n, uint8_t *dst, size_t bytes);
+static int      cache_unpin(uint64_t b);
+
+/* compression (block_set_compress): a block goes into its own slot packed
+ * when that saves an eighth of it or more, the rest of the slot is a
+ * hole. ctab, stored after the journal, has the packed length of each
+ * block (0 = raw); packed blocks are only ever read through the cache */
+#define COMP_STAGE 64 /* packed writes queued before a drain */
+/* the host only gives back whole pages: a slot of a page or less never
+ * shrinks, so those images store blocks raw whatever -z says */
+#define COMP_FITS(bsize) ((bsize) > IMG_PAGE)
+static int       comp_want;   /* new images get a length table */
+static uint32_t *ctab;        /* NULL: this image stores every block raw */
+static uint64_t *ctab_dirty;  /* per IMG_PAGE of the table, saved at checkpoint */
+static uint8_t  *comp_buf;    /* COMP_STAGE queued writes, then 2 scratch blocks */
+static size_t    comp_next;   /* next free staging slot */
+
+/* lazy zeroing: a free block's bytes are left as they are, and a new one
+ * is only zeroed when something reads it before overwriting it whole */
+static uint64_t *zero_blocks; /* allocated, still holding stale bytes */
+static void bit_clear(uint64_t *bits, uint64_t i);
+static int  bit_test(const uint64_t *bits, uint64_t i);
+static void zero_now(uint64_t b, uint8_t *p);
+
+/* dedup index entries only count while their block is untouched since */
+static uint64_t *dd_live;
+
+/* checksums: crc32c of each block as last written to the image, in a
+ * table after the journal. a block coming back from the image is checked
+ * against it (cache fills, raw reads, the first touch of a mapped block),
+ * block_scrub checks all of them */
+static uint32_t *csum;        /* NULL: image without checksums */
+static uint64_t *csum_dirty;  /* per IMG_PAGE of the table, saved at checkpoint */
+static int       csum_loaded; /* the table describes the image file */
+static uint64_t *csum_seen;   /* mapped: blocks checked since mount */
+static size_t    csum_errors;
+static int      csum_touch(uint64_t b, const uint8_t *p);
+static uint32_t crc32c(uint32_t crc, const void *p, size_t len);
+
+/* a block's bytes, valid until the next blk_get / blk_new */
+static uint8_t *blk_get(uint64_t b)
+{
+    int stale = zero_blocks && bit_test(zero_blocks, b);
+    uint8_t *p = cache_n ? cache_get(b, !stale) : block_data + (size_t)b * g_geo.bsize;
+    if (p && stale) zero_now(b, p);
+    else if (p && csum_seen && !bit_test(csum_seen, b) && csum_touch(b, p) != 0) return NULL;
+    return p;
+}
+
+/* same, for a block about to be overwritten whole: nothing is read */
+static uint8_t *blk_new(uint64_t b)
+{
+    if (zero_blocks) bit_clear(zero_blocks, b);
+    if (cache_n) return cache_get(b, 0);
+    return block_data + (size_t)b * g_geo.bsize;
+}
+
+static size_t align_up(size_t v, size_t a)
+{
+    return (v + a - 1) / a * a;
+}
+
+static int blkno_valid(int blkno)
+{
+    return blkno >= 0 && (uint64_t)blkno < g_geo.count;
+}
+
+
+static size_t bitmap_bytes(uint64_t count)
+{
+    return (size_t)((count + 63) / 64) * sizeof(uint64_t);
+}
+
+static int geometry_valid(uint64_t bsize, uint64_t count)
+{
+    if (bsize < BLOCK_SIZE_MIN || bsize > BLOCK_SIZE_MAX) return 0;
+    if (bsize & (bsize - 1)) return 0;      /* power of two */
+    if (count == 0 || count > INT32_MAX) return 0; /* block numbers are int */
+    if (count > (SIZE_MAX - IMG_PAGE) / bsize / 2) return 0; /* journal fits too */
+    return 1;
+}
+
+/* journal size for a new image: 1/8 of the device, within bounds */
+static uint32_t journal_default_blocks(uint64_t count)
+{
+    uint64_t n = count / 8;
+    if (n < JRNL_MIN_BLOCKS) n = JRNL_MIN_BLOCKS;
+    if (n > JRNL_MAX_BLOCKS) n = JRNL_MAX_BLOCKS;
+    return (uint32_t)n;
+}
+
+static void geometry_set_journal(img_geom_t *g, uint32_t journal_blocks)
+{
+    g->map_size       = g->data_off + (size_t)g->count * g->bsize;
+    g->journal_off    = g->map_size;
+    g->journal_blocks = journal_blocks;
+    g->csum_off       = 0;
+    g->ctab_off       = 0;
+    g->img_size       = g->map_size + (size_t)journal_blocks * g->bsize;
+}
+
+/* per-block tables after the journal, each from a page boundary:
+ * checksums, then compressed lengths (the one that can be added later) */
+static void geometry_set_tables(img_geom_t *g, int csum_on, int ctab_on)
+{
+    size_t end = g->journal_off + (size_t)g->journal_blocks * g->bsize;
+    size_t tab = (size_t)g->count * sizeof(uint32_t);
+
+    g->csum_off = csum_on ? align_up(end, IMG_PAGE) : 0;
+    if (csum_on) end = g->csum_off + tab;
+    g->ctab_off = ctab_on ? align_up(end, IMG_PAGE) : 0;
+    if (ctab_on) end = g->ctab_off + tab;
+    g->img_size = end;
+}
+
+static size_t img_hdr_size(uint32_t version)
+{
+    if (version >= 5) return sizeof(img_hdr_t);
+    return version == 4 ? IMG_HDR_V4_SIZE : IMG_HDR_V3_SIZE;
+}
+
+/* fill in the layout for a new VFS2 image */
+static void geometry_set(img_geom_t *g, size_t bsize, uint64_t count)
+{
+    size_t align = bsize > IMG_PAGE ? bsize : IMG_PAGE;
+
+    g->version    = IMG_VERSION;
+    g->bsize      = bsize;
+    g->count      = count;
+    g->bitmap_off = sizeof(img_hdr_t);
+    g->data_off   = align_up(g->bitmap_off + bitmap_bytes(count), align);
+    g->byte_bitmap = 0;
+    geometry_set_journal(g, journal_default_blocks(count));
+    geometry_set_tables(g, 1, comp_want && COMP_FITS(bsize));
+}
+
+/* read the layout out of an on-disk header (VFS1 or VFS2) */
+static int geometry_from_header(img_geom_t *g, const uint8_t *raw, size_t raw_len)
+{
+    uint32_t magic;
+    memcpy(&magic, raw, sizeof(magic));
+
+    if (magic == IMG_MAGIC_V1) {
+        img_hdr_v1_t h1;
+        memcpy(&h1, raw, sizeof(h1));
+        if (!geometry_valid(h1.block_size, h1.block_count)) return -1;
+
+        g->version    = 0;
+        g->bsize      = h1.block_size;
+        g->count      = h1.block_count;
+        g->bitmap_off = sizeof(h1);
+        g->data_off   = g->bitmap_off + (size_t)h1.block_count;
+        g->byte_bitmap = 1;
+        geometry_set_journal(g, 0);
+        return 0;
+    }
+
+    if (magic != IMG_MAGIC || raw_len < IMG_HDR_V3_SIZE) return -1;
+
+    img_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(&hdr, raw, IMG_HDR_V3_SIZE);
+    if (hdr.version == 0 || hdr.version > IMG_VERSION) return -1;
+    if (hdr.version >= 4) {
+        if (raw_len < img_hdr_size(hdr.version)) return -1;
+        memcpy(&hdr, raw, img_hdr_size(hdr.version));
+    }
+    if (!geometry_valid(hdr.block_size, hdr.block_count)) return -1;
+    if (hdr.version < 3) hdr.journal_blocks = 0; /* was reserved */
+    if (hdr.journal_blocks > JRNL_MAX_BLOCKS ||
+        (hdr.journal_blocks && hdr.journal_blocks < JRNL_MIN_BLOCKS)) return -1;
+
+    g->byte_bitmap = (hdr.version == 1);
+    size_t map_len = g->byte_bitmap ? (size_t)hdr.block_count : bitmap_bytes(hdr.block_count);
+    if (hdr.bitmap_off < img_hdr_size(hdr.version) || hdr.bitmap_off % sizeof(uint64_t) ||
+        hdr.data_off < hdr.bitmap_off + map_len) return -1;
+
+    g->version    = hdr.version;
+    g->bsize      = hdr.block_size;
+    g->count      = hdr.block_count;
+    g->bitmap_off = (size_t)hdr.bitmap_off;
+    g->data_off   = (size_t)hdr.data_off;
+    geometry_set_journal(g, hdr.journal_blocks);
+    geometry_set_tables(g, hdr.csum_off != 0, hdr.ctab_off != 0);
+    /* the tables are always where we put them */
+    if (hdr.csum_off != g->csum_off || hdr.ctab_off != g->ctab_off) return -1;
+    return 0;
+}
+
+static void img_set_base(uint8_t *base)
+{
+    img_base     = base;
+    block_data   = cache_n ? NULL : base + g_geo.data_off;
+}
+
+/* ---------- allocation bitmap ----------
+ * bm_words: one bit per block (1 = used), stored packed in the image.
+ * bm_sum:   one bit per bitmap word, set while that word still has a free
+ *           bit, so finding a free block is a ctz on each level.
+ * bits past the last block stay set so they never look free.
+ * allocation groups: the device in runs of 1 << grp_shift blocks (whole
+ * bitmap words), each its own slice of the bitmap with its own free count.
+ * a file's blocks come from its directory's group first. */
+static uint64_t *bm_words;
+static uint64_t *bm_sum;
+static size_t    bm_nwords;
+static uint64_t  bm_used;   /* live count, df never walks the bitmap */
+static uint32_t *grp_free;
+static size_t    grp_n;
+static unsigned  grp_shift;
+
+static void bm_sum_update(size_t w)
+{
+    uint64_t bit = 1ull << (w & 63);
+    if (bm_words[w] != ~0ull) bm_sum[w >> 6] |= bit;
+    else                      bm_sum[w >> 6] &= ~bit;
+}
+
+static int bm_test(uint64_t b)
+{
+    return (int)((bm_words[b >> 6] >> (b & 63)) & 1);
+}
+
+/* ---------- dirty tracking ----------
+ * what changed since the last checkpoint: one bit per block and one bit
+ * per bitmap word. a checkpoint only writes these into the image.
+ * txn_*: the same for the open journal transaction, i.e. what changed
+ * since the last commit; txn_bytes is what logging it will take. */
+static uint64_t *dirty_blocks;
+static uint64_t *dirty_bm;
+static uint64_t *txn_blocks;
+static uint64_t *txn_bm;
+static size_t    txn_bytes;
+/* freed since the last checkpoint: their image space goes back then */
+static uint64_t *punch_blocks;
+/* allocated since the last checkpoint and not freed since: the image
+ * holds nothing of theirs anyone needs, so block_submit_write may put
+ * them straight into their slot */
+static uint64_t *fresh_blocks;
+/* submitted writes in flight, all within blocks [sub_lo, sub_hi) */
+static uint64_t *sub_blocks;
+static uint64_t  sub_lo, sub_hi;
+static int       sub_csum;    /* their checksums aren't in the image yet */
+
+static int jrnl_active(void);
+
+static void bit_set(uint64_t *bits, uint64_t i)
+{
+    bits[i >> 6] |= 1ull << (i & 63);
+}
+
+static void bit_clear(uint64_t *bits, uint64_t i)
+{
+    bits[i >> 6] &= ~(1ull << (i & 63));
+}
+
+static int bit_test(const uint64_t *bits, uint64_t i)
+{
+    return (int)((bits[i >> 6] >> (i & 63)) & 1);
+}
+
+static void txn_note(uint64_t *bits, uint64_t i, size_t cost)
+{
+    if (!jrnl_active() || bit_test(bits, i)) return;
+    bit_set(bits, i);
+    txn_bytes += cost;
+}
+
+static void dirty_block(uint64_t b)
+{
+    if (dd_live) bit_clear(dd_live, b);
+    bit_set(dirty_blocks, b);
+    txn_note(txn_blocks, b, JREC_BLOCK_COST);
+}
+
+/* pages of a per-block uint32 table */
+static size_t tab_pages(void)
+{
+    return ((size_t)g_geo.count * sizeof(uint32_t) + IMG_PAGE - 1) / IMG_PAGE;
+}
+
+static void dirty_clear(void)
+{
+    memset(dirty_blocks, 0, bitmap_bytes(g_geo.count));
+    memset(dirty_bm, 0, bitmap_bytes(bm_nwords));
+    memset(punch_blocks, 0, bitmap_bytes(g_geo.count));
+    memset(fresh_blocks, 0, bitmap_bytes(g_geo.count));
+    sub_csum = 0;
+    if (ctab_dirty) memset(ctab_dirty, 0, bitmap_bytes(tab_pages()));
+    if (csum_dirty) memset(csum_dirty, 0, bitmap_bytes(tab_pages()));
+}
+
+static void txn_clear(void)
+{
+    memset(txn_blocks, 0, bitmap_bytes(g_geo.count));
+    memset(txn_bm, 0, bitmap_bytes(bm_nwords));
+    txn_bytes = 0;
+}
+
+static int dirty_attach(void)
+{
+    free(dirty_blocks);
+    free(dirty_bm);
+    free(txn_blocks);
+    free(txn_bm);
+    free(zero_blocks);
+    free(punch_blocks);
+    free(fresh_blocks);
+    free(sub_blocks);
+    dirty_blocks = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    dirty_bm     = (uint64_t *)calloc(1, bitmap_bytes(bm_nwords));
+    txn_blocks   = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    txn_bm       = (uint64_t *)calloc(1, bitmap_bytes(bm_nwords));
+    zero_blocks  = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    punch_blocks = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    fresh_blocks = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    sub_blocks   = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    txn_bytes    = 0;
+    sub_lo = sub_hi = 0;
+    sub_csum     = 0;
+    return (dirty_blocks && dirty_bm && txn_blocks && txn_bm && zero_blocks &&
+            punch_blocks && fresh_blocks && sub_blocks) ? 0 : -1;
+}
+
+static void zero_now(uint64_t b, uint8_t *p)
+{
+    memset(p, 0, g_geo.bsize);
+    bit_clear(zero_blocks, b);
+    dirty_block(b);
+}
+
+/* next run of set bits in [from, limit); 0 when there is none */
+static int next_run(const uint64_t *bits, uint64_t from, uint64_t limit,
+                    uint64_t *start, uint64_t *len)
+{
+    uint64_t b = from;
+
+    while (b < limit) {
+        uint64_t m = bits[b >> 6] >> (b & 63);
+        if (m) { b += (uint64_t)__builtin_ctzll(m); break; }
+        b = (b | 63) + 1;
+    }
+    if (b >= limit) return 0;
+
+    *start = b;
+    while (b < limit) {
+        unsigned avail = 64 - (unsigned)(b & 63);
+        uint64_t clear = ~bits[b >> 6] >> (b & 63);
+        unsigned run   = clear ? (unsigned)__builtin_ctzll(clear) : avail;
+
+        b += run;
+        if (run < avail) break;
+    }
+    if (b > limit) b = limit;
+    *len = b - *start;
+    return 1;
+}
+
+/* zero whatever was allocated and never written, so no committed or
+ * saved image has stale bytes inside a file */
+static void zero_flush(void)
+{
+    uint64_t s, n, pos = 0;
+
+    if (!zero_blocks) return;
+    while (next_run(zero_blocks, pos, g_geo.count, &s, &n)) {
+        for (uint64_t b = s; b < s + n; b++) blk_get(b);
+        pos = s + n;
+    }
+}
+
+/* a bitmap word changed: keep the summary in step and remember to save it */
+static void bm_word_changed(size_t w)
+{
+    bm_sum_update(w);
+    bit_set(dirty_bm, w);
+    txn_note(txn_bm, w, JREC_WORD_COST);
+}
+
+static void bm_set(uint64_t b)
+{
+    uint64_t bit = 1ull << (b & 63);
+    if (bm_words[b >> 6] & bit) return;
+    bm_words[b >> 6] |= bit;
+    bm_used++;
+    grp_free[b >> grp_shift]--;
+    bm_word_changed((size_t)(b >> 6));
+}
+
+static void bm_clear(uint64_t b)
+{
+    uint64_t bit = 1ull << (b & 63);
+    if (!(bm_words[b >> 6] & bit)) return;
+    bm_words[b >> 6] &= ~bit;
+    bm_used--;
+    grp_free[b >> grp_shift]++;
+    bm_word_changed((size_t)(b >> 6));
+}
+
+/* first bitmap word at or after `from` that has a free bit */
+static size_t bm_next_free_word(size_t from)
+{
+    size_t nsum = (bm_nwords + 63) / 64;
+
+    for (size_t si = from >> 6; si < nsum; si++) {
+        uint64_t m = bm_sum[si];
+        if (si == (from >> 6)) m &= ~0ull << (from & 63);
+        if (m) return si * 64 + (size_t)__builtin_ctzll(m);
+    }
+    return SIZE_MAX;
+}
+
+/* first free block at or after `from`, -1 if none up to the end */
+static int64_t bm_next_free(uint64_t from)
+{
+    if (from >= g_geo.count) return -1;
+
+    size_t   w = (size_t)(from >> 6);
+    uint64_t m = ~bm_words[w] & (~0ull << (from & 63));
+    if (m) return (int64_t)(w * 64 + (size_t)__builtin_ctzll(m));
+
+    size_t nw = bm_next_free_word(w + 1);
+    if (nw == SIZE_MAX) return -1;
+    return (int64_t)(nw * 64 + (size_t)__builtin_ctzll(~bm_words[nw]));
+}
+
+/* first free block at or after goal, wrapping around once; -1 if full */
+static int64_t bm_find_free(uint64_t goal)
+{
+    if (bm_used >= g_geo.count) return -1;
+    if (goal >= g_geo.count) goal = 0;
+
+    int64_t b = bm_next_free(goal);
+    if (b < 0) b = bm_next_free(0);
+    return b;
+}
+
+/* length of the free run starting at b, at most max */
+static uint64_t bm_run_len(uint64_t b, uint64_t max)
+{
+    uint64_t len = 0;
+
+    while (len < max && b < g_geo.count) {
+        unsigned avail = 64 - (unsigned)(b & 63);
+        uint64_t used  = bm_words[b >> 6] >> (b & 63);
+        unsigned run   = used ? (unsigned)__builtin_ctzll(used) : avail;
+
+        len += run;
+        if (run < avail) break;
+        b += run;
+    }
+    return len < max ? len : max;
+}
+
+/* mark [b, b+n) used or free a word at a time */
+static void bm_set_range(uint64_t b, uint64_t n, int used)
+{
+    while (n > 0) {
+        size_t   w     = (size_t)(b >> 6);
+        unsigned shift = (unsigned)(b & 63);
+        unsigned take  = 64 - shift;
+        if (take > n) take = (unsigned)n;
+
+        uint64_t mask = (take == 64) ? ~0ull : (((1ull << take) - 1) << shift);
+        uint64_t old  = bm_words[w];
+        uint32_t *gf  = &grp_free[b >> grp_shift];
+
+        if (used) {
+            unsigned d = (unsigned)__builtin_popcountll(~old & mask);
+            bm_words[w] |= mask;
+            bm_used += d;
+            *gf -= d;
+        } else {
+            unsigned d = (unsigned)__builtin_popcountll(old & mask);
+            bm_words[w] &= ~mask;
+            bm_used -= d;
+            *gf += d;
+        }
+        bm_word_changed(w);
+
+        b += take;
+        n -= take;
+    }
+}
+
+/* summary + counter from the bitmap words as they are now */
+static void bm_rebuild(void)
+{
+    unsigned pad = (unsigned)(bm_nwords * 64 - g_geo.count);
+    if (pad) bm_words[bm_nwords - 1] |= ~0ull << (64 - pad);
+
+    bm_used = 0;
+    for (size_t g = 0; g < grp_n; g++) grp_free[g] = 0;
+    for (size_t w = 0; w < bm_nwords; w++) {
+        unsigned used = (unsigned)__builtin_popcountll(bm_words[w]);
+        bm_used += used;
+        grp_free[(w * 64) >> grp_shift] += 64 - used;
+        bm_sum_update(w);
+    }
+    bm_used -= pad;
+}
+
+/* one bitmap block per group like ext4, smaller on small devices so there
+ * are a few of them; never below 512 blocks */
+static int grp_attach(void)
+{
+    grp_shift = 3;
+    while ((1ull << grp_shift) < (uint64_t)g_geo.bsize * 8) grp_shift++;
+    while (grp_shift > 9 && (g_geo.count >> grp_shift) < 8) grp_shift--;
+    grp_n = (size_t)((g_geo.count + (1ull << grp_shift) - 1) >> grp_shift);
+
+    free(grp_free);
+    grp_free = (uint32_t *)calloc(grp_n, sizeof(uint32_t));
+    return grp_free ? 0 : -1;
+}
+
+/* ---------- sharing ----------
+ * blocks owned by more than one file (reflink copies). nearly every block
+ * has a single owner, so only the extra references are kept, in an
+ * open-addressed table keyed by block number. nothing of this is stored:
+ * the metadata lists every owner and mount counts them (block_claim). */
+typedef struct {
+    int64_t  blk;     /* -1 empty */
+    uint32_t extra;   /* owners beyond the first */
+} ref_slot_t;
+
+static ref_slot_t *ref_tab;
+static size_t      ref_cap;   /* power of two, 0 = nothing shared yet */
+static size_t      ref_used;
+static size_t      ref_extra; /* sum of extra over the table */
+static uint64_t   *ref_claimed; /* blocks block_claim has seen this mount */
+
+static size_t ref_hash(uint64_t b)
+{
+    return (size_t)((b * 0x9E3779B97F4A7C15ull) >> 32) & (ref_cap - 1);
+}
+
+static ref_slot_t *ref_find(uint64_t b)
+{
+    if (!ref_cap) return NULL;
+    for (size_t i = ref_hash(b); ref_tab[i].blk >= 0; i = (i + 1) & (ref_cap - 1)) {
+        if ((uint64_t)ref_tab[i].blk == b) return &ref_tab[i];
+    }
+    return NULL;
+}
+
+static void ref_place(ref_slot_t r)
+{
+    size_t i = ref_hash((uint64_t)r.blk);
+    while (ref_tab[i].blk >= 0) i = (i + 1) & (ref_cap - 1);
+    ref_tab[i] = r;
+}
+
+static int ref_add(uint64_t b)
+{
+    ref_slot_t *r = ref_find(b);
+    if (r) { r->extra++; ref_extra++; return 0; }
+
+    if ((ref_used + 1) * 2 > ref_cap) {
+        size_t old_cap = ref_cap;
+        ref_slot_t *old = ref_tab;
+        size_t cap = ref_cap ? ref_cap * 2 : 64;
+        ref_slot_t *t = (ref_slot_t *)malloc(cap * sizeof(ref_slot_t));
+        if (!t) return -1;
+        for (size_t i = 0; i < cap; i++) t[i].blk = -1;
+        ref_tab = t;
+        ref_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].blk >= 0) ref_place(old[i]);
+        }
+        free(old);
+    }
+
+    ref_slot_t n = { (int64_t)b, 1 };
+    ref_place(n);
+    ref_used++;
+    ref_extra++;
+    return 0;
+}
+
+/* one owner less: 1 if the block still has one, 0 if it was exclusive */
+static int ref_drop(uint64_t b)
+{
+    ref_slot_t *r = ref_find(b);
+    if (!r) return 0;
+    ref_extra--;
+    if (--r->extra > 0) return 1;
+
+    /* empty the slot, pulling later entries of the probe chain back */
+    size_t i = (size_t)(r - ref_tab);
+    for (size_t j = (i + 1) & (ref_cap - 1); ref_tab[j].blk >= 0; j = (j + 1) & (ref_cap - 1)) {
+        size_t h = ref_hash((uint64_t)ref_tab[j].blk);
+        int stays = (i <= j) ? (i < h && h <= j) : (i < h || h <= j);
+        if (!stays) {
+            ref_tab[i] = ref_tab[j];
+            i = j;
+        }
+    }
+    ref_tab[i].blk = -1;
+    ref_used--;
+    return 1;
+}
+
+static int ref_reset(void)
+{
+    free(ref_tab);
+    free(ref_claimed);
+    ref_tab = NULL;
+    ref_cap = ref_used = ref_extra = 0;
+    ref_claimed = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    return ref_claimed ? 0 : -1;
+}
+
+/* ---------- dedup ----------
+ * opt-in (block_set_dedup): file blocks are indexed by a 64-bit hash of
+ * their bytes, and a write of bytes some block already holds takes one
+ * more owner of that block instead of a new one. the index lives in
+ * memory, mount fills it with the file blocks the metadata lists. a hit
+ * is compared byte for byte, and only counts while the block is still
+ * allocated and unchanged (dd_live, cleared by any write to it). */
+typedef struct {
+    uint64_t hash;
+    int64_t  blk;     /* -1 empty */
+} dd_slot_t;
+
+static int        dd_want;
+static dd_slot_t *dd_tab;
+static size_t     dd_cap;     /* power of two */
+static size_t     dd_used;
+static uint8_t   *dd_tmp;     /* one block: a short buffer zero-filled */
+
+static uint64_t dd_hash(const uint8_t *p, size_t len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        h = (h ^ (v * 0xBF58476D1CE4E5B9ull)) * 0x94D049BB133111EBull;
+        h ^= h >> 31;
+    }
+    return h;
+}
+
+static int dd_valid(const dd_slot_t *d)
+{
+    return d->blk >= 0 && bm_test((uint64_t)d->blk) && bit_test(dd_live, (uint64_t)d->blk);
+}
+
+/* slot holding hash, or the empty slot where it goes */
+static dd_slot_t *dd_slot(uint64_t hash)
+{
+    size_t i = (size_t)hash & (dd_cap - 1);
+    while (dd_tab[i].blk >= 0 && dd_tab[i].hash != hash) i = (i + 1) & (dd_cap - 1);
+    return &dd_tab[i];
+}
+
+/* room for one more: grow, leaving entries that went stale behind */
+static int dd_grow(void)
+{
+    if (dd_tab && (dd_used + 1) * 2 <= dd_cap) return 0;
+
+    size_t live = 0;
+    for (size_t i = 0; i < dd_cap; i++) live += dd_valid(&dd_tab[i]);
+    size_t cap = 64;
+    while (cap < (live + 1) * 4) cap <<= 1;
+
+    dd_slot_t *t = (dd_slot_t *)malloc(cap * sizeof(dd_slot_t));
+    if (!t) return -1;
+    for (size_t i = 0; i < cap; i++) t[i].blk = -1;
+
+    dd_slot_t *old = dd_tab;
+    size_t old_cap = dd_cap;
+    dd_tab = t;
+    dd_cap = cap;
+    dd_used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!dd_valid(&old[i])) continue;
+        *dd_slot(old[i].hash) = old[i];
+        dd_used++;
+    }
+    free(old);
+    return 0;
+}
+
+static void dd_reset(void)
+{
+    free(dd_tab);
+    free(dd_live);
+    free(dd_tmp);
+    dd_tab = NULL;
+    dd_live = NULL;
+    dd_tmp = NULL;
+    dd_cap = dd_used = 0;
+}
+
+/* buf as a whole block, zero-filled past len */
+static const uint8_t *dd_block(const void *buf, size_t len)
+{
+    if (len >= g_geo.bsize) return (const uint8_t *)buf;
+    if (len) memcpy(dd_tmp, buf, len);
+    memset(dd_tmp + len, 0, g_geo.bsize - len);
+    return dd_tmp;
+}
+
+/* length table for the current image, all raw until it is read in */
+static int comp_attach(void)
+{
+    free(ctab);
+    free(ctab_dirty);
+    free(comp_buf);
+    ctab = NULL;
+    ctab_dirty = NULL;
+    comp_buf = NULL;
+    comp_next = 0;
+    if (!g_geo.ctab_off) return 0;
+
+    ctab       = (uint32_t *)calloc((size_t)g_geo.count, sizeof(uint32_t));
+    ctab_dirty = (uint64_t *)calloc(1, bitmap_bytes(tab_pages()));
+    comp_buf   = (uint8_t *)malloc((COMP_STAGE + 2) * g_geo.bsize);
+    return (ctab && ctab_dirty && comp_buf) ? 0 : -1;
+}
+
+static int csum_attach(void)
+{
+    free(csum);
+    free(csum_dirty);
+    free(csum_seen);
+    csum = NULL;
+    csum_dirty = NULL;
+    csum_seen = NULL;
+    csum_loaded = 0;
+    csum_errors = 0;
+    if (!g_geo.csum_off) return 0;
+
+    csum       = (uint32_t *)malloc((size_t)g_geo.count * sizeof(uint32_t));
+    csum_dirty = (uint64_t *)calloc(1, bitmap_bytes(tab_pages()));
+    uint8_t *zero = (uint8_t *)calloc(1, g_geo.bsize);
+    if (csum && zero) {
+        /* a block that was never written reads as zeros (the meta header
+         * of a fresh image, reserved before its first save) */
+        uint32_t c = crc32c(0, zero, g_geo.bsize);
+        for (uint64_t b = 0; b < g_geo.count; b++) csum[b] = c;
+    }
+    free(zero);
+    return (csum && csum_dirty) ? 0 : -1;
+}
+
+/* the table was read in from the image: checks start */
+static int csum_load_done(void)
+{
+    csum_loaded = 1;
+    if (cache_n) return 0; /* every read from the file is checked as it lands */
+    csum_seen = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+    return csum_seen ? 0 : -1;
+}
+
+/* p holds block b as the image file has it: 0 if it matches */
+static int csum_verify(uint64_t b, const uint8_t *p)
+{
+    if (!csum_loaded || !bm_test(b) || bit_test(zero_blocks, b)) return 0;
+    if (crc32c(0, p, g_geo.bsize) == csum[b]) return 0;
+    csum_errors++;
+    return -1;
+}
+
+/* blocks [b, b + len / bsize) read straight from the image */
+static int csum_verify_run(uint64_t b, const uint8_t *p, size_t len)
+{
+    int rc = 0;
+    for (size_t off = 0; off + g_geo.bsize <= len; off += g_geo.bsize, b++) {
+        if (csum_verify(b, p + off) != 0) rc = -1;
+    }
+    return rc;
+}
+
+/* mapped: first access to a block since mount, check it unless it has
+ * already changed in memory */
+static int csum_touch(uint64_t b, const uint8_t *p)
+{
+    if (!bit_test(dirty_blocks, b) && csum_verify(b, p) != 0) return -1;
+    bit_set(csum_seen, b);
+    return 0;
+}
+
+/* block b is on its way to the image as p */
+static void csum_note(uint64_t b, const uint8_t *p)
+{
+    uint32_t c = crc32c(0, p, g_geo.bsize);
+
+    if (csum[b] != c) {
+        csum[b] = c;
+        bit_set(csum_dirty, (uint64_t)b * sizeof(uint32_t) / IMG_PAGE);
+    }
+    if (csum_seen) bit_set(csum_seen, b);
+}
+
+static int comp_packed(uint64_t b)
+{
+    return ctab && ctab[b] != 0;
+}
+
+/* what goes into block b's slot: the packed form, built in tmp, or the
+ * block itself; keeps the length table in step */
+static const uint8_t *comp_pack(uint64_t b, const uint8_t *p, uint8_t *tmp, size_t *len)
+{
+    size_t bs = g_geo.bsize;
+    size_t c = lz_compress(p, bs, tmp, bs - bs / 8);
+
+    if (ctab[b] != (uint32_t)c) {
+        ctab[b] = (uint32_t)c;
+        bit_set(ctab_dirty, (uint64_t)b * sizeof(uint32_t) / IMG_PAGE);
+    }
+    *len = c ? c : bs;
+    return c ? tmp : p;
+}
+
+/* hook up the bitmap of the current image and rebuild summary + counter;
+ * the device starts out clean */
+static int bm_attach(void)
+{
+    free(bm_sum);
+    bm_words  = (uint64_t *)(img_base + g_geo.bitmap_off);
+    bm_nwords = bitmap_bytes(g_geo.count) / sizeof(uint64_t);
+    bm_sum    = (uint64_t *)calloc((bm_nwords + 63) / 64, sizeof(uint64_t));
+    if (!bm_sum || grp_attach() != 0) return -1;
+
+    bm_rebuild();
+    dd_reset();
+    if (ref_reset() != 0 || comp_attach() != 0 || csum_attach() != 0) return -1;
+    return dirty_attach();
+}
+
+static int legacy_read(FILE *fp, const img_geom_t *old)
+{
+    uint8_t chunk[4096];
+
+    if (fseek(fp, (long)old->bitmap_off, SEEK_SET) != 0) return -1;
+    for (uint64_t b = 0; b < old->count; ) {
+        size_t n = sizeof(chunk);
+        if (n > old->count - b) n = (size_t)(old->count - b);
+        if (fread(chunk, 1, n, fp) != n) return -1;
+        for (size_t i = 0; i < n; i++) {
+            if (chunk[i]) bm_set(b + i);
+        }
+        b += n;
+    }
+
+    /* free blocks stay zero, only the used runs are read */
+    uint64_t s, n, pos = 0;
+    while (next_run(bm_words, pos, old->count, &s, &n)) {
+        size_t len = (size_t)n * old->bsize;
+        if (fseek(fp, (long)(old->data_off + s * old->bsize), SEEK_SET) != 0) return -1;
+        if (fread(block_data + (size_t)s * old->bsize, 1, len, fp) != len) return -1;
+        pos = s + n;
+    }
+    return 0;
+}
+
+/* byte-bitmap images (VFS1, VFS2 v1) can't be used in place: copy them into
+ * a fresh device, the next save writes the current layout */
+static int img_convert_legacy(const char *filename, const img_geom_t *old)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return -1;
+
+    int rc = block_format(old->bsize, old->count);
+    if (rc == 0) rc = legacy_read(fp, old);
+    if (rc == 0) img_set_path(filename, 0);
+
+    fclose(fp);
+    return rc;
+}
+
+/* ---------- writing the image out ----------
+ * positioned writes into an image file: the whole used set for a new file,
+ * or just the dirty bitmap words and blocks for an incremental save */
+#ifndef _WIN32
+typedef int img_out_t;
+static int ioq_write(int fd, size_t off, const void *p, size_t len);
+static int ioq_drain(void);
+#else
+typedef FILE *img_out_t;
+#endif
+
+/* give the whole pages inside [from, to) back to the filesystem */
+static void out_hole(img_out_t o, size_t from, size_t to)
+{
+#if !defined(_WIN32) && defined(FALLOC_FL_PUNCH_HOLE)
+    from = align_up(from, IMG_PAGE);
+    to = to / IMG_PAGE * IMG_PAGE;
+    if (to > from)
+        (void)fallocate(o, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)from, (off_t)(to - from));
+#else
+    (void)o; (void)from; (void)to;
+#endif
+}
+
+/* the slot tail a packed block leaves unused */
+static void out_punch(img_out_t o, size_t off, size_t len)
+{
+    out_hole(o, off + len, off + g_geo.bsize);
+}
+
+static int out_write(img_out_t o, size_t off, const void *p, size_t len)
+{
+#ifndef _WIN32
+    const uint8_t *c = (const uint8_t *)p;
+    while (len > 0) {
+        ssize_t n = pwrite(o, c, len, (off_t)off);
+        if (n <= 0) return -1;
+        c += n; off += (size_t)n; len -= (size_t)n;
+    }
+    return 0;
+#else
+    if (_fseeki64(o, (long long)off, SEEK_SET) != 0) return -1;
+    return fwrite(p, 1, len, o) == len ? 0 : -1;
+#endif
+}
+
+/* block data is queued where many writes can be in flight (see ioq),
+ * out_flush waits for all of it */
+static int out_queue(img_out_t o, size_t off, const void *p, size_t len)
+{
+#ifndef _WIN32
+    return ioq_write(o, off, p, len);
+#else
+    return out_write(o, off, p, len);
+#endif
+}
+
+static int out_flush(void)
+{
+    comp_next = 0; /* staged writes are done once this returns */
+#ifndef _WIN32
+    return ioq_drain();
+#else
+    return 0;
+#endif
+}
+
+/* pages [p, p + n) of a per-block table stored at off */
+static int out_table(img_out_t o, size_t off, const uint32_t *tab, uint64_t p, uint64_t n)
+{
+    size_t from = (size_t)p * IMG_PAGE;
+    size_t to   = (size_t)(p + n) * IMG_PAGE;
+    size_t all  = (size_t)g_geo.count * sizeof(uint32_t);
+
+    if (to > all) to = all;
+    return out_write(o, off + from, (const uint8_t *)tab + from, to - from);
+}
+
+/* the dirty pages of one */
+static int out_table_dirty(img_out_t o, size_t off, const uint32_t *tab, const uint64_t *dirty)
+{
+    uint64_t s, n, pos = 0;
+
+    while (next_run(dirty, pos, tab_pages(), &s, &n)) {
+        if (out_table(o, off, tab, s, n) != 0) return -1;
+        pos = s + n;
+    }
+    return 0;
+}
+
+static int out_bitmap_words(img_out_t o, uint64_t w, uint64_t n)
+{
+    return out_write(o, g_geo.bitmap_off + (size_t)w * sizeof(uint64_t),
+                     bm_words + w, (size_t)n * sizeof(uint64_t));
+}
+
+static int out_blocks(img_out_t o, uint64_t b, uint64_t n)
+{
+    if (ctab) {
+        /* packed copies sit in the staging area until their write is done */
+        size_t bs = g_geo.bsize;
+        for (; n > 0; b++, n--) {
+            size_t off = g_geo.data_off + (size_t)b * bs, len;
+            const uint8_t *p = blk_get(b);
+            if (!p) return -1;
+            if (csum) csum_note(b, p);
+            if (comp_next == COMP_STAGE && out_flush() != 0) return -1;
+
+            uint8_t *stage = comp_buf + comp_next * bs;
+            p = comp_pack(b, p, stage, &len);
+            if (p == stage) comp_next++;
+            if (out_queue(o, off, p, len) != 0) return -1;
+            if (len < bs) out_punch(o, off, len);
+        }
+        return 0;
+    }
+    if (cache_n) {
+        /* cached blocks are not contiguous in memory: one at a time */
+        for (; n > 0; b++, n--) {
+            const uint8_t *p = blk_get(b);
+            if (!p) return -1;
+            if (csum) csum_note(b, p);
+            if (out_queue(o, g_geo.data_off + (size_t)b * g_geo.bsize, p, g_geo.bsize) != 0) return -1;
+        }
+        return 0;
+    }
+    const uint8_t *p = blk_get(b);
+    if (!p) return -1;
+    for (uint64_t k = 0; csum && k < n; k++) csum_note(b + k, p + (size_t)k * g_geo.bsize);
+    return out_queue(o, g_geo.data_off + (size_t)b * g_geo.bsize, p, (size_t)n * g_geo.bsize);
+}
+
+/* new image file: header, whole bitmap, used blocks; free space stays a hole */
+static int img_write_all(img_out_t o)
+{
+    uint64_t s, n, pos = 0;
+    int rc = 0;
+
+    if (out_write(o, 0, img_base, img_hdr_size(g_geo.version)) != 0) return -1;
+    if (out_bitmap_words(o, 0, bm_nwords) != 0) return -1;
+
+    while (rc == 0 && next_run(bm_words, pos, g_geo.count, &s, &n)) {
+        rc = out_blocks(o, s, n);
+        pos = s + n;
+    }
+    if (out_flush() != 0) rc = -1;
+    if (rc == 0 && csum) rc = out_table(o, g_geo.csum_off, csum, 0, tab_pages());
+    if (rc == 0 && ctab) rc = out_table(o, g_geo.ctab_off, ctab, 0, tab_pages());
+    return rc;
+}
+
+/* byte offset of block b in the image */
+static size_t blk_off(uint64_t b)
+{
+    return g_geo.data_off + (size_t)b * g_geo.bsize;
+}
+
+/* blocks freed since the last checkpoint and still free: holes in the
+ * file from here on, so its size follows what is in use. a run grows
+ * over free neighbours up to page boundaries, so blocks smaller than a
+ * page still add up to whole pages */
+static void out_free_runs(img_out_t o)
+{
+    uint64_t s, n, pos = 0;
+
+    while (next_run(punch_blocks, pos, g_geo.count, &s, &n)) {
+        for (uint64_t b = s, e = s; b < s + n; b = e) {
+            while (b < s + n && bm_test(b)) b++;
+            for (e = b; e < s + n && !bm_test(e); e++) ;
+            if (e == b) continue;
+
+            uint64_t lo = b, hi = e;
+            while (lo > 0 && blk_off(lo) % IMG_PAGE && !bm_test(lo - 1)) lo--;
+            while (hi < g_geo.count && blk_off(hi) % IMG_PAGE && !bm_test(hi)) hi++;
+            out_hole(o, blk_off(lo), blk_off(hi));
+        }
+        pos = s + n;
+    }
+}
+
+/* existing image file: only what changed since the last checkpoint */
+static int img_write_dirty(img_out_t o)
+{
+    uint64_t s, n, pos = 0;
+    int rc = 0;
+
+    /* reads still in flight land before their blocks get written over */
+    out_flush();
+
+    while (next_run(dirty_bm, pos, bm_nwords, &s, &n)) {
+        if (out_bitmap_words(o, s, n) != 0) return -1;
+        pos = s + n;
+    }
+    pos = 0;
+    while (rc == 0 && next_run(dirty_blocks, pos, g_geo.count, &s, &n)) {
+        rc = out_blocks(o, s, n);
+        pos = s + n;
+    }
+    if (out_flush() != 0) rc = -1;
+    out_free_runs(o);
+    if (rc == 0 && csum) rc = out_table_dirty(o, g_geo.csum_off, csum, csum_dirty);
+    if (rc == 0 && ctab) rc = out_table_dirty(o, g_geo.ctab_off, ctab, ctab_dirty);
+    return rc;
+}
+
+static void img_header(const img_geom_t *g, img_hdr_t *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = IMG_MAGIC;
+    hdr->version = g->version;
+    hdr->block_size = (uint32_t)g->bsize;
+    hdr->journal_blocks = g->journal_blocks;
+    hdr->block_count = g->count;
+    hdr->bitmap_off = g->bitmap_off;
+    hdr->data_off = g->data_off;
+    hdr->ctab_off = g->ctab_off;
+    hdr->csum_off = g->csum_off;
+}
+
+static void img_fill_header(void)
+{
+    img_hdr_t hdr;
+    img_header(&g_geo, &hdr);
+    memcpy(img_base, &hdr, img_hdr_size(g_geo.version));
+}
+
+/* crc32c (Castagnoli): the SSE4.2 crc32 instruction where the cpu has
+ * it, else slicing-by-8. crc32c_init picks one and builds the tables; the
+ * first crc32c does it if nobody has, and block_scrub does it before its
+ * workers start so none of them ever sees half a table */
+static uint32_t crc_table[8][256];
+static int      crc_hw = -1;    /* -1: crc32c_init hasn't run */
+
+static void crc32c_init(void)
+{
+    if (crc_hw >= 0) return;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t v = i;
+        for (int k = 0; k < 8; k++) v = (v >> 1) ^ (0x82F63B78u & (0u - (v & 1)));
+        crc_table[0][i] = v;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+    }
+#ifdef CRC_SSE42
+    crc_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    crc_hw = 0;
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *c, size_t len)
+{
+    uint32_t (*table)[256] = crc_table;
+
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, c, 4);
+        memcpy(&hi, c + 4, 4);
+        lo ^= crc; /* little endian */
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        c += 8;
+        len -= 8;
+    }
+    while (len--) crc = table[0][(crc ^ *c++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *c, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t v64 = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, c, sizeof(v));
+        v64 = _mm_crc32_u64(v64, v);
+        c += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)v64;
+#endif
+    while (len--) crc = _mm_crc32_u8(crc, *c++);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void *p, size_t len)
+{
+    crc32c_init();
+#ifdef CRC_SSE42
+    if (crc_hw) return ~crc32c_hw(~crc, (const uint8_t *)p, len);
+#endif
+    return ~crc32c_sw(~crc, (const uint8_t *)p, len);
+}
+
+#ifndef _WIN32
+
+static void cache_free(void);
+static void ioq_settle(void);
+
+static void img_release(void)
+{
+    ioq_settle();
+    if (img_base && cache_n) free(img_base); /* header + bitmap copy */
+    else if (img_base) munmap(img_base, g_geo.map_size);
+    cache_free();
+    if (img_fd >= 0) close(img_fd);
+    img_base = NULL;
+    img_fd = -1;
+    img_path[0] = '\0';
+    img_current = 0;
+}
+
+static int in_read(int fd, size_t off, void *p, size_t len)
+{
+    uint8_t *c = (uint8_t *)p;
+    while (len > 0) {
+        ssize_t n = pread(fd, c, len, (off_t)off);
+        if (n <= 0) return -1;
+        c += n; off += (size_t)n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* ---------- async image IO ----------
+ * an io_uring on the image file where the kernel has one: a checkpoint
+ * queues every dirty block and waits once, a cache miss reads all its
+ * stretches side by side, block_submit_* queue a block each and
+ * block_poll reaps them. a request that carries on where the one queued
+ * just before it ends, in the file and in memory, joins it. the buffer
+ * cache arena and the caller's submit buffer are registered so their
+ * blocks go with the _FIXED ops. elsewhere a request simply runs when
+ * it is queued. a drain reports failures of everything since the last
+ * one */
+#define IOQ_DEPTH   64
+#define IOQ_MAX_LEN (1u << 30)   /* one sqe moves at most this much */
+#define IOQ_BUF_CACHE 0          /* registered buffers, by use */
+#define IOQ_BUF_SUBMIT 1
+#define IOQ_NBUF    2
+
+typedef struct {
+    int      fd;
+    int      write;
+    uint8_t *p;
+    size_t   off;
+    size_t   len;
+    int64_t  check;   /* read of whole blocks from here on to verify, -1 none */
+} ioq_req_t;
+
+static ioq_req_t ioq_reqs[IOQ_DEPTH];
+static int       ioq_slots[IOQ_DEPTH];  /* free request slots, a stack */
+static int       ioq_nfree;
+static int       ioq_inflight;
+static int       ioq_failed;
+
+#ifdef IOQ_URING
+static int       ioq_ring = -1;        /* -1 not set up yet, -2 unavailable */
+static unsigned  ioq_queued;           /* sqes not submitted yet */
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *ioq_sqes;
+static struct io_uring_cqe *ioq_cqes;
+static int       ioq_last = -1;        /* slot of the sqe queued last, -1 gone */
+static uint8_t  *ioq_buf[IOQ_NBUF];    /* buffers to register, NULL none */
+static size_t    ioq_buf_len[IOQ_NBUF];
+static int       ioq_buf_idx[IOQ_NBUF] = { -1, -1 }; /* their index with the ring */
+static int       ioq_nreg;
+
+static int ioq_setup(void)
+{
+    if (ioq_ring != -1) return ioq_ring >= 0 ? 0 : -1;
+    ioq_ring = -2;
+
+    struct io_uring_params prm;
+    memset(&prm, 0, sizeof(prm));
+    int fd = (int)syscall(__NR_io_uring_setup, IOQ_DEPTH, &prm);
+    if (fd < 0) return -1;
+
+    size_t sq_sz = prm.sq_off.array + prm.sq_entries * sizeof(unsigned);
+    size_t cq_sz = prm.cq_off.cqes + prm.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (prm.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_sz > sq_sz) sq_sz = cq_sz;
+
+    uint8_t *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = single ? sq : mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, prm.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd); /* the process keeps running synchronously; maps go with it */
+        return -1;
+    }
+
+    sq_tail  = (unsigned *)(sq + prm.sq_off.tail);
+    sq_mask  = (unsigned *)(sq + prm.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + prm.sq_off.array);
+    cq_head  = (unsigned *)(cq + prm.cq_off.head);
+    cq_tail  = (unsigned *)(cq + prm.cq_off.tail);
+    cq_mask  = (unsigned *)(cq + prm.cq_off.ring_mask);
+    ioq_sqes = (struct io_uring_sqe *)sqes;
+    ioq_cqes = (struct io_uring_cqe *)(cq + prm.cq_off.cqes);
+    ioq_ring = fd;
+    return 0;
+}
+
+/* pin p[0..len) as fixed buffer `which`, NULL drops it. the ring takes
+ * its buffers all at once, so the set is registered again as a whole */
+static void ioq_register(int which, uint8_t *p, size_t len)
+{
+    ioq_buf[which] = p;
+    ioq_buf_len[which] = p ? len : 0;
+    if (ioq_ring == -2 || (!p && ioq_nreg == 0)) return;
+
+    ioq_settle(); /* nothing in flight may use the old set */
+    if (ioq_nreg) {
+        syscall(__NR_io_uring_register, ioq_ring, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        ioq_nreg = 0;
+    }
+    for (int i = 0; i < IOQ_NBUF; i++) ioq_buf_idx[i] = -1;
+    if (ioq_setup() != 0) return;
+
+    struct iovec v[IOQ_NBUF];
+    int n = 0;
+    for (int i = 0; i < IOQ_NBUF; i++) {
+        if (!ioq_buf[i]) continue;
+        v[n].iov_base = ioq_buf[i];
+        v[n].iov_len = ioq_buf_len[i];
+        ioq_buf_idx[i] = n++;
+    }
+    if (n && syscall(__NR_io_uring_register, ioq_ring, IORING_REGISTER_BUFFERS, v, n) == 0) {
+        ioq_nreg = n;
+    } else {
+        for (int i = 0; i < IOQ_NBUF; i++) ioq_buf_idx[i] = -1;
+    }
+}
+
+/* index of the registered buffer p[0..n) lies in, -1 none */
+static int ioq_fixed(const uint8_t *p, size_t n)
+{
+    for (int i = 0; i < IOQ_NBUF; i++) {
+        if (ioq_buf_idx[i] >= 0 && p >= ioq_buf[i] && p + n <= ioq_buf[i] + ioq_buf_len[i])
+            return ioq_buf_idx[i];
+    }
+    return -1;
+}
+#else
+static void ioq_register(int which, uint8_t *p, size_t len)
+{
+    (void)which; (void)p; (void)len;
+}
+#endif
+
+static void ioq_done(int slot, int64_t res)
+{
+    ioq_req_t *r = &ioq_reqs[slot];
+
+    if (res < 0) {
+        ioq_failed++;
+    } else if ((size_t)res < r->len) {
+        /* short transfer: finish it here */
+        size_t k = (size_t)res;
+        int rc = r->write ? out_write(r->fd, r->off + k, r->p + k, r->len - k)
+                          : in_read(r->fd, r->off + k, r->p + k, r->len - k);
+        if (rc != 0) { ioq_failed++; res = -1; }
+    }
+    if (res >= 0 && r->check >= 0 && csum_verify_run((uint64_t)r->check, r->p, r->len) != 0)
+        ioq_failed++;
+    ioq_slots[ioq_nfree++] = slot;
+    ioq_inflight--;
+}
+
+/* hand queued sqes to the kernel, wait for min completions, reap what is in */
+static int ioq_enter(unsigned min)
+{
+#ifdef IOQ_URING
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, ioq_ring, ioq_queued, min,
+                         min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) { ioq_queued -= (unsigned)n; break; }
+        if (errno != EINTR) return -1;
+    }
+    ioq_last = -1; /* what was queued may be in the kernel's hands now */
+
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *c = &ioq_cqes[head & *cq_mask];
+        ioq_done((int)c->user_data, c->res);
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+#else
+    (void)min;
+#endif
+    return 0;
+}
+
+static int ioq_push(int fd, int write, uint8_t *p, size_t off, size_t len, int64_t check)
+{
+#ifdef IOQ_URING
+    if (ioq_setup() == 0) {
+        if (ioq_nfree == 0 && ioq_inflight == 0) {
+            for (int i = 0; i < IOQ_DEPTH; i++) ioq_slots[i] = IOQ_DEPTH - 1 - i;
+            ioq_nfree = IOQ_DEPTH;
+        }
+        if (ioq_last >= 0) {
+            /* carries on where the last queued one ends: one sqe for both */
+            ioq_req_t *r = &ioq_reqs[ioq_last];
+            struct io_uring_sqe *e = &ioq_sqes[(*sq_tail - 1) & *sq_mask];
+            int fixed = ioq_fixed(r->p, r->len + len);
+            if (r->fd == fd && r->write == write && r->p + r->len == p &&
+                r->off + r->len == off && r->len + len <= IOQ_MAX_LEN &&
+                (r->check < 0) == (check < 0) &&
+                fixed == (e->opcode == IORING_OP_READ_FIXED ||
+                          e->opcode == IORING_OP_WRITE_FIXED ? (int)e->buf_index : -1)) {
+                r->len += len;
+                e->len = (uint32_t)r->len;
+                return 0;
+            }
+        }
+        while (len > 0) {
+            size_t n = len > IOQ_MAX_LEN ? IOQ_MAX_LEN : len;
+            if (ioq_nfree == 0 && ioq_enter(1) != 0) return -1;
+
+            int slot = ioq_slots[--ioq_nfree];
+            ioq_req_t r = { fd, write, p, off, n, check };
+            ioq_reqs[slot] = r;
+
+            unsigned tail = *sq_tail;
+            unsigned idx = tail & *sq_mask;
+            struct io_uring_sqe *e = &ioq_sqes[idx];
+            memset(e, 0, sizeof(*e));
+            int fixed = ioq_fixed(p, n);
+            if (write) e->opcode = fixed >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            else       e->opcode = fixed >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            if (fixed >= 0) e->buf_index = (uint16_t)fixed;
+            e->fd = fd;
+            e->off = off;
+            e->addr = (uint64_t)(uintptr_t)p;
+            e->len = (uint32_t)n;
+            e->user_data = (uint64_t)slot;
+            sq_array[idx] = idx;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ioq_queued++;
+            ioq_inflight++;
+            ioq_last = slot;
+
+            p += n; off += n; len -= n;
+            if (check >= 0) check += (int64_t)(n / g_geo.bsize);
+        }
+        return 0;
+    }
+#endif
+    if (write) return out_write(fd, off, p, len);
+    if (in_read(fd, off, p, len) != 0) return -1;
+    return check >= 0 ? csum_verify_run((uint64_t)check, p, len) : 0;
+}
+
+static int ioq_write(int fd, size_t off, const void *p, size_t len)
+{
+    return ioq_push(fd, 1, (uint8_t *)(uintptr_t)p, off, len, -1);
+}
+
+/* len bytes of data blocks from b on; whole blocks are checked on arrival */
+static int ioq_read_blocks(int fd, uint64_t b, void *p, size_t len)
+{
+    return ioq_push(fd, 0, (uint8_t *)p, g_geo.data_off + (size_t)b * g_geo.bsize, len,
+                    csum_loaded ? (int64_t)b : -1);
+}
+
+/* nothing in flight: no submitted write is pending any more */
+static void sub_clear(void)
+{
+    if (sub_hi > sub_lo)
+        memset(sub_blocks + (sub_lo >> 6), 0, (size_t)((sub_hi + 63) / 64 - (sub_lo >> 6)) * 8);
+    sub_lo = sub_hi = 0;
+}
+
+/* wait until nothing is in flight */
+static void ioq_settle(void)
+{
+    while (ioq_inflight > 0) {
+        if (ioq_enter((unsigned)ioq_inflight) != 0) {
+            /* the ring is unusable: nothing more will complete */
+            ioq_failed += ioq_inflight;
+            ioq_inflight = 0;
+            ioq_nfree = 0;
+        }
+    }
+    sub_clear();
+}
+
+/* settle, -1 if anything failed since the last drain */
+static int ioq_drain(void)
+{
+    ioq_settle();
+    int failed = ioq_failed;
+    ioq_failed = 0;
+    return failed ? -1 : 0;
+}
+
+/* ---------- journal ----------
+ * redo log after the data area. changes gather in the open transaction
+ * (txn_*) and block_commit() logs them with one fdatasync, however many
+ * operations that covers. the image proper is only written at a
+ * checkpoint, after which the log starts over; mount replays every
+ * transaction that checks out. */
+static uint64_t jrnl_seq;   /* number of the next transaction */
+static uint64_t jrnl_first; /* the superblock's seq */
+static size_t   jrnl_tail;  /* log bytes in use */
+static int      jrnl_committing; /* block_commit gathering the batch */
+static int      jrnl_ovf;   /* the file may run on past img_size */
+
+#define JRNL_CHUNK (1u << 20) /* records go out this much at a time */
+
+static int jrnl_active(void)
+{
+    return img_fd >= 0 && g_geo.journal_blocks > 0;
+}
+
+static size_t jrnl_log_off(void)
+{
+    return g_geo.journal_off + g_geo.bsize;
+}
+
+size_t block_log_capacity(void)
+{
+    return jrnl_active() ? (size_t)(g_geo.journal_blocks - 1) * g_geo.bsize : 0;
+}
+
+size_t block_pending(void)
+{
+    return txn_bytes ? sizeof(jtxn_hdr_t) + txn_bytes : 0;
+}
+
+/* where an overflow transaction goes: past everything the image holds */
+static size_t jrnl_ovf_off(void)
+{
+    return align_up(g_geo.img_size, IMG_PAGE);
+}
+
+static int jrnl_write_sb(uint32_t flags)
+{
+    jrnl_sb_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = JRNL_MAGIC;
+    sb.flags = flags;
+    sb.seq = jrnl_first;
+    if (out_write(img_fd, g_geo.journal_off, &sb, sizeof(sb)) != 0) return -1;
+    return fdatasync(img_fd) != 0 ? -1 : 0;
+}
+
+/* empty the log: transactions before jrnl_seq are dead from here on */
+static int jrnl_reset(void)
+{
+    if (!jrnl_active()) return 0;
+
+    jrnl_first = jrnl_seq;
+    out_hole(img_fd, jrnl_log_off(), jrnl_log_off() + jrnl_tail); /* dead records */
+    if (jrnl_write_sb(0) != 0) return -1;
+    jrnl_tail = 0;
+    if (jrnl_ovf) {
+        if (ftruncate(img_fd, (off_t)g_geo.img_size) != 0) return -1;
+        jrnl_ovf = 0;
+    }
+    return 0;
+}
+
+/* write what changed into the image proper, then the log can go */
+static int img_checkpoint(void)
+{
+    if (img_write_dirty(img_fd) != 0 || fdatasync(img_fd) != 0) return -1;
+    dirty_clear();
+    return jrnl_reset();
+}
+
+static uint8_t *jrec_put(uint8_t *p, uint32_t type, uint64_t where,
+                         const void *data, size_t len)
+{
+    jrec_t r = { type, (uint32_t)len, where };
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), data, len);
+    return p + sizeof(r) + len;
+}
+
+/* records gathered in buf go out at *off, into the running crc */
+static int jrnl_out(const uint8_t *buf, size_t *used, size_t *off, uint32_t *crc)
+{
+    *crc = crc32c(*crc, buf, *used);
+    if (out_write(img_fd, *off, buf, *used) != 0) return -1;
+    *off += *used;
+    *used = 0;
+    return 0;
+}
+
+/* the open transaction as one jtxn at `at`: records a chunk at a time,
+ * the header last, once the crc is known */
+static int jrnl_put_txn(size_t at)
+{
+    size_t cap = JRNL_CHUNK > JREC_BLOCK_COST ? JRNL_CHUNK : JREC_BLOCK_COST;
+    uint8_t *buf = (uint8_t *)malloc(cap);
+    if (!buf) return -1;
+
+    size_t off = at + sizeof(jtxn_hdr_t), used = 0;
+    uint32_t crc = 0;
+    uint64_t s, n, pos = 0;
+    int rc = 0;
+
+    jrnl_committing = 1;
+    while (rc == 0 && next_run(txn_blocks, pos, g_geo.count, &s, &n)) {
+        for (uint64_t b = s; rc == 0 && b < s + n; b++) {
+            if (used + JREC_BLOCK_COST > cap) rc = jrnl_out(buf, &used, &off, &crc);
+            const uint8_t *d = rc == 0 ? blk_get(b) : NULL;
+            if (!d) rc = -1;
+            else used = (size_t)(jrec_put(buf + used, JREC_BLOCK, b, d, g_geo.bsize) - buf);
+        }
+        pos = s + n;
+    }
+    jrnl_committing = 0;
+    pos = 0;
+    while (rc == 0 && next_run(txn_bm, pos, bm_nwords, &s, &n)) {
+        for (uint64_t w = s; rc == 0 && w < s + n; w++) {
+            if (used + JREC_WORD_COST > cap) rc = jrnl_out(buf, &used, &off, &crc);
+            if (rc == 0)
+                used = (size_t)(jrec_put(buf + used, JREC_WORD, w, bm_words + w, sizeof(uint64_t)) - buf);
+        }
+        pos = s + n;
+    }
+    if (rc == 0 && used > 0) rc = jrnl_out(buf, &used, &off, &crc);
+    free(buf);
+    if (rc != 0) return -1;
+
+    jtxn_hdr_t h = { JTXN_MAGIC, crc, jrnl_seq, txn_bytes };
+    return out_write(img_fd, at, &h, sizeof(h));
+}
+
+int block_commit(void)
+{
+    if (!jrnl_active()) return 0;
+
+    jrnl_committing = 1;
+    zero_flush();
+    jrnl_committing = 0;
+    if (txn_bytes == 0) return 0;
+
+    /* blocks written straight to their slots, and their checksums, are
+     * in the image before any transaction that refers to them */
+    if (sub_csum) {
+        ioq_settle();
+        if (ioq_failed) return -1; /* block_poll still reports it */
+        if (csum && out_table_dirty(img_fd, g_geo.csum_off, csum, csum_dirty) != 0) return -1;
+        sub_csum = 0;
+    }
+
+    size_t len = sizeof(jtxn_hdr_t) + txn_bytes;
+    if (len > block_log_capacity() - jrnl_tail) {
+        /* a batch bigger than the free part of the log: one transaction
+         * past the end of the image, committed by the superblock flag and
+         * cut off again by the checkpoint right after */
+        jrnl_ovf = 1;
+        if (jrnl_put_txn(jrnl_ovf_off()) != 0 || fdatasync(img_fd) != 0) return -1;
+        if (jrnl_write_sb(JRNL_OVERFLOW) != 0) return -1;
+        jrnl_seq++;
+        txn_clear();
+        return img_checkpoint();
+    }
+
+    /* the whole batch: one write, one fdatasync */
+    if (jrnl_put_txn(jrnl_log_off() + jrnl_tail) != 0 || fdatasync(img_fd) != 0) return -1;
+
+    jrnl_tail += len;
+    jrnl_seq++;
+    txn_clear();
+
+    /* keep half the log free for the next batch */
+    if (jrnl_tail > block_log_capacity() / 2) return img_checkpoint();
+    return 0;
+}
+
+/* redo one logged transaction on the device */
+static int jrnl_apply(const uint8_t *p, size_t len)
+{
+    while (len >= sizeof(jrec_t)) {
+        jrec_t r;
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+        len -= sizeof(r);
+        if (r.len > len) return -1;
+
+        if (r.type == JREC_BLOCK && r.where < g_geo.count && r.len == g_geo.bsize) {
+            uint8_t *d = blk_new(r.where);
+            if (!d) return -1;
+            memcpy(d, p, r.len);
+            bit_set(dirty_blocks, r.where);
+        } else if (r.type == JREC_WORD && r.where < bm_nwords && r.len == sizeof(uint64_t)) {
+            memcpy(bm_words + r.where, p, r.len);
+            bit_set(dirty_bm, r.where);
+        } else {
+            return -1;
+        }
+        p += r.len;
+        len -= r.len;
+    }
+    return 0;
+}
+
+/* the transaction at `at`, with room bytes it may take: 1 applied (its
+ * length in *len), 0 torn or not the next one, -1 error */
+static int jrnl_replay_one(size_t at, size_t room, size_t *len)
+{
+    jtxn_hdr_t h;
+
+    if (room < sizeof(h) || in_read(img_fd, at, &h, sizeof(h)) != 0) return 0;
+    if (h.magic != JTXN_MAGIC || h.seq != jrnl_seq ||
+        h.len == 0 || h.len > room - sizeof(h)) return 0;
+
+    uint8_t *body = (uint8_t *)malloc((size_t)h.len);
+    if (!body) return -1;
+    int ok = in_read(img_fd, at + sizeof(h), body, (size_t)h.len) == 0 &&
+             crc32c(0, body, (size_t)h.len) == h.crc &&
+             jrnl_apply(body, (size_t)h.len) == 0;
+    free(body);
+    if (!ok) return 0; /* torn: this batch never committed */
+
+    *len = sizeof(h) + (size_t)h.len;
+    jrnl_seq++;
+    return 1;
+}
+
+/* mount: redo whatever the log holds, then checkpoint it away */
+static int jrnl_replay(void)
+{
+    jrnl_sb_t sb;
+    struct stat st;
+    size_t cap = block_log_capacity();
+    int replayed = 0, rc = 1;
+
+    jrnl_tail = 0;
+    jrnl_ovf = fstat(img_fd, &st) == 0 && (uint64_t)st.st_size > g_geo.img_size;
+    if (in_read(img_fd, g_geo.journal_off, &sb, sizeof(sb)) != 0 || sb.magic != JRNL_MAGIC) {
+        jrnl_seq = 1;
+        return jrnl_reset(); /* new image, or the journal was just added */
+    }
+    jrnl_seq = jrnl_first = sb.seq;
+
+    while (rc > 0) {
+        size_t len;
+        rc = jrnl_replay_one(jrnl_log_off() + jrnl_tail, cap - jrnl_tail, &len);
+        if (rc < 0) return -1;
+        if (rc > 0) {
+            jrnl_tail += len;
+            replayed++;
+        }
+    }
+    if ((sb.flags & JRNL_OVERFLOW) && jrnl_ovf) {
+        size_t len;
+        rc = jrnl_replay_one(jrnl_ovf_off(), (size_t)st.st_size - jrnl_ovf_off(), &len);
+        if (rc < 0) return -1;
+        replayed += rc;
+    }
+    if (!replayed) {
+        /* an overflow that never committed: cut it off */
+        if (jrnl_ovf && !(sb.flags & JRNL_OVERFLOW) &&
+            ftruncate(img_fd, (off_t)g_geo.img_size) == 0) jrnl_ovf = 0;
+        return 0;
+    }
+
+    bm_rebuild();
+    return img_checkpoint();
+}
+
+/* image from before the journal: grow one onto the end of the file,
+ * or run without one if that fails */
+static void jrnl_add(int fd, img_geom_t *g)
+{
+    img_geom_t ng = *g;
+    img_hdr_t hdr;
+    struct stat st;
+
+    if (ng.version < 3) ng.version = 3; /* same header size as v2 */
+    geometry_set_journal(&ng, journal_default_blocks(ng.count));
+    img_header(&ng, &hdr);
+
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < g->img_size) return;
+    if ((uint64_t)st.st_size < ng.img_size && ftruncate(fd, (off_t)ng.img_size) != 0) return;
+    if (out_write(fd, 0, &hdr, img_hdr_size(ng.version)) != 0 || fdatasync(fd) != 0) return;
+    *g = ng;
+}
+
+/* compression asked for on an image without a length table: add one,
+ * every block raw so far. headers before v4 have no room for it */
+static void ctab_add(int fd, img_geom_t *g)
+{
+    img_geom_t ng = *g;
+    img_hdr_t hdr;
+    struct stat st;
+
+    if (g->version < 4) return;
+    geometry_set_tables(&ng, g->csum_off != 0, 1);
+    img_header(&ng, &hdr);
+
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < g->img_size) return;
+    /* a batch logged past the end has to be replayed first: next mount */
+    if ((uint64_t)st.st_size > g->img_size) return;
+    /* cut back first so the whole table reads as zeros */
+    if (ftruncate(fd, (off_t)g->img_size) != 0 ||
+        ftruncate(fd, (off_t)ng.img_size) != 0 || fdatasync(fd) != 0) return;
+    if (out_write(fd, 0, &hdr, img_hdr_size(ng.version)) != 0 || fdatasync(fd) != 0) return;
+    *g = ng;
+}
+
+/* ---------- buffer cache ----------
+ * cache_n block buffers over the data area of the image file, CLOCK
+ * eviction. a buffer is dirty while its block's dirty bit is set, and
+ * eviction writes it home first. blocks of the open transaction stay put:
+ * the redo log needs them off the image until they commit. so do pinned
+ * buffers (block_get). */
+static uint8_t *cache_mem;   /* cache_n * bsize */
+static int64_t *cache_blk;   /* block held by each buffer, -1 none */
+static uint8_t *cache_ref;   /* CLOCK reference bits */
+static uint16_t *cache_pins; /* block_get holders */
+static uint8_t  *cache_wr;   /* some holder writes to it */
+static uint8_t  *cache_tmp;  /* one block of scratch for cache_read_run */
+static int32_t *cache_next;  /* hash chains */
+static int32_t *cache_head;  /* cache_nhash buckets */
+static size_t   cache_nhash;
+static size_t   cache_hand;
+
+static size_t cache_hash(uint64_t b)
+{
+    return (size_t)((b * 0x9E3779B97F4A7C15ull) >> 32) & (cache_nhash - 1);
+}
+
+static void cache_free(void)
+{
+    ioq_settle();
+    if (cache_mem) ioq_register(IOQ_BUF_CACHE, NULL, 0);
+    free(cache_mem);
+    free(cache_blk);
+    free(cache_ref);
+    free(cache_pins);
+    free(cache_wr);
+    free(cache_tmp);
+    free(cache_next);
+    free(cache_head);
+    cache_mem = NULL;
+    cache_blk = NULL;
+    cache_ref = NULL;
+    cache_pins = NULL;
+    cache_wr = NULL;
+    cache_tmp = NULL;
+    cache_next = NULL;
+    cache_head = NULL;
+    cache_n = 0;
+}
+
+static int cache_alloc(size_t n)
+{
+    cache_free();
+    cache_nhash = 1;
+    while (cache_nhash < n) cache_nhash <<= 1;
+
+    cache_mem  = (uint8_t *)malloc(n * g_geo.bsize);
+    cache_blk  = (int64_t *)malloc(n * sizeof(int64_t));
+    cache_ref  = (uint8_t *)calloc(n, 1);
+    cache_pins = (uint16_t *)calloc(n, sizeof(uint16_t));
+    cache_wr   = (uint8_t *)calloc(n, 1);
+    cache_tmp  = (uint8_t *)malloc(g_geo.bsize);
+    cache_next = (int32_t *)malloc(n * sizeof(int32_t));
+    cache_head = (int32_t *)malloc(cache_nhash * sizeof(int32_t));
+    if (!cache_mem || !cache_blk || !cache_ref || !cache_pins || !cache_wr || !cache_tmp ||
+        !cache_next || !cache_head) {
+        cache_free();
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) cache_blk[i] = -1;
+    for (size_t h = 0; h < cache_nhash; h++) cache_head[h] = -1;
+    cache_n = n;
+    cache_hand = 0;
+    ioq_register(IOQ_BUF_CACHE, cache_mem, n * g_geo.bsize);
+    return 0;
+}
+
+static int cache_find(uint64_t b)
+{
+    for (int32_t i = cache_head[cache_hash(b)]; i >= 0; i = cache_next[i]) {
+        if ((uint64_t)cache_blk[i] == b) return i;
+    }
+    return -1;
+}
+
+/* a buffer to reuse: CLOCK, passing over the open transaction and pins;
+ * SIZE_MAX when everything is pinned */
+static size_t cache_victim(void)
+{
+    for (size_t scan = 0; scan < 4 * cache_n; scan++) {
+        if (scan == 2 * cache_n && !jrnl_committing) {
+            /* the open transaction fills the cache: commit it early */
+            if (block_commit() != 0) txn_clear();
+        }
+
+        size_t i = cache_hand;
+        cache_hand = (cache_hand + 1) % cache_n;
+
+        if (cache_blk[i] < 0) return i;
+        if (cache_pins[i]) continue;
+        if (bit_test(txn_blocks, (uint64_t)cache_blk[i])) continue;
+        if (cache_ref[i]) { cache_ref[i] = 0; continue; }
+        return i;
+    }
+    return SIZE_MAX;
+}
+
+/* write the buffer home if dirty and drop it from the hash */
+static int cache_evict(size_t i)
+{
+    if (cache_blk[i] < 0) return 0;
+
+    uint64_t b = (uint64_t)cache_blk[i];
+    if (bit_test(dirty_blocks, b)) {
+        size_t off = g_geo.data_off + (size_t)b * g_geo.bsize, len = g_geo.bsize;
+        const uint8_t *p = cache_mem + i * g_geo.bsize;
+
+        ioq_settle(); /* no read of this spot may still be in flight */
+        if (csum) csum_note(b, p);
+        if (ctab) p = comp_pack(b, p, comp_buf + (COMP_STAGE + 1) * g_geo.bsize, &len);
+        if (out_write(img_fd, off, p, len) != 0) return -1;
+        if (len < g_geo.bsize) out_punch(img_fd, off, len);
+        bit_clear(dirty_blocks, b);
+    }
+
+    int32_t *pp = &cache_head[cache_hash(b)];
+    while (*pp != (int32_t)i) pp = &cache_next[*pp];
+    *pp = cache_next[i];
+    cache_blk[i] = -1;
+    return 0;
+}
+
+/* block b from its slot in the image, unpacked if need be */
+static int cache_load(uint64_t b, uint8_t *out)
+{
+    size_t off = g_geo.data_off + (size_t)b * g_geo.bsize;
+
+    if (bit_test(sub_blocks, b)) ioq_settle(); /* its submitted write lands first */
+    if (!comp_packed(b)) {
+        if (in_read(img_fd, off, out, g_geo.bsize) != 0) return -1;
+        return csum_verify(b, out);
+    }
+    if (ctab[b] >= g_geo.bsize) return -1;
+
+    uint8_t *in = comp_buf + COMP_STAGE * g_geo.bsize;
+    if (in_read(img_fd, off, in, ctab[b]) != 0) return -1;
+    if (lz_decompress(in, ctab[b], out, g_geo.bsize) != 0) return -1;
+    return csum_verify(b, out);
+}
+
+static uint8_t *cache_get(uint64_t b, int fill)
+{
+    int i = cache_find(b);
+
+    if (i < 0) {
+        size_t v = cache_victim();
+        if (v == SIZE_MAX || cache_evict(v) != 0) return NULL;
+
+        uint8_t *buf = cache_mem + v * g_geo.bsize;
+        if (fill && cache_load(b, buf) != 0) return NULL;
+
+        size_t h = cache_hash(b);
+        i = (int)v;
+        cache_blk[i]  = (int64_t)b;
+        cache_next[i] = cache_head[h];
+        cache_head[h] = i;
+    }
+    cache_ref[i] = 1;
+    return cache_mem + (size_t)i * g_geo.bsize;
+}
+
+static void cache_pin(uint64_t b, int wr)
+{
+    int i = cache_find(b);
+    if (i < 0) return;
+    cache_pins[i]++;
+    if (wr) cache_wr[i] = 1;
+}
+
+/* 1 if a holder wrote to it */
+static int cache_unpin(uint64_t b)
+{
+    int i = cache_find(b);
+    if (i < 0 || cache_pins[i] == 0) return 0;
+
+    int wr = cache_wr[i];
+    if (--cache_pins[i] == 0) cache_wr[i] = 0;
+    return wr;
+}
+
+/* n blocks from b into dst: cached ones are copied, each stretch of
+ * uncached raw ones is one read, all of them in flight together and
+ * checked as they land, packed ones are unpacked one by one; the cache
+ * is left alone */
+static int cache_read_run(uint64_t b, uint64_t n, uint8_t *dst, size_t bytes)
+{
+    size_t bs = g_geo.bsize;
+    int rc = 0;
+
+    if (sub_hi > b && sub_lo < b + n) ioq_settle(); /* submitted writes land first */
+    for (uint64_t i = 0; i < n && rc == 0; ) {
+        size_t off = (size_t)i * bs;
+        int c = cache_find(b + i);
+        if (c >= 0) {
+            memcpy(dst + off, cache_mem + (size_t)c * bs, bytes - off < bs ? bytes - off : bs);
+            cache_ref[c] = 1;
+            i++;
+            continue;
+        }
+        /* packed, or a checked block dst only has part of a room for */
+        if (comp_packed(b + i) || (csum_loaded && bytes - off < bs)) {
+            rc = cache_load(b + i, cache_tmp);
+            memcpy(dst + off, cache_tmp, bytes - off < bs ? bytes - off : bs);
+            i++;
+            continue;
+        }
+
+        uint64_t j = i + 1;
+        while (j < n && cache_find(b + j) < 0 && !comp_packed(b + j) &&
+               !(csum_loaded && bytes - (size_t)j * bs < bs)) j++;
+        size_t end = (size_t)j * bs < bytes ? (size_t)j * bs : bytes;
+        rc = ioq_read_blocks(img_fd, b + i, dst + off, end - off);
+        i = j;
+    }
+    if (ioq_drain() != 0) rc = -1;
+    return rc;
+}
 
 /* define function */
-int block_init(void)
+int block_format(size_t block_size, uint64_t block_count)
+{
+    if (!geometry_valid(block_size, block_count)) return -1;
+
+    img_release();
+    geometry_set(&g_geo, block_size, block_count);
+
+    /* anonymous pages stay untouched (and free) until a block is used */
+    void *p = mmap(NULL, g_geo.map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+
+    img_set_base((uint8_t *)p);
+    img_fill_header();
+    return bm_attach();
+}
+
+int block_load_image(const char *filename)
+{
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        /* 第一次沒有檔案很正常 */
+        return -1;
+    }
+
+    uint8_t raw[sizeof(img_hdr_t)];
+    memset(raw, 0, sizeof(raw));
+    ssize_t got = pread(fd, raw, sizeof(raw), 0);
+    if (got < (ssize_t)sizeof(img_hdr_v1_t)) { close(fd); return -1; }
+
+    img_geom_t geo;
+    if (geometry_from_header(&geo, raw, (size_t)got) != 0) { close(fd); return -1; }
+    if (geo.byte_bitmap) {
+        close(fd);
+        return img_convert_legacy(filename, &geo);
+    }
+    if (geo.journal_blocks == 0) jrnl_add(fd, &geo);
+    if (comp_want && COMP_FITS(geo.bsize) && !geo.ctab_off) ctab_add(fd, &geo);
+
+    /* packed blocks can't be mapped: they always go through the cache */
+    size_t ncache = cache_want;
+    if (!ncache && geo.ctab_off) ncache = BLOCK_CACHE_COMPRESS;
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= geo.map_size) {
+        if (ncache) {
+            /* bounded memory: header + bitmap on the heap, blocks via the cache */
+            p = malloc(geo.data_off);
+            if (!p) p = MAP_FAILED;
+            else if (in_read(fd, 0, p, geo.data_off) != 0) { free(p); p = MAP_FAILED; }
+        } else {
+            /* map the image itself: nothing is read up front, pages fault in
+             * on use. private, so the file only changes via journal + checkpoint */
+            p = mmap(NULL, geo.map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+    }
+    if (p == MAP_FAILED) { close(fd); return -1; }
+
+    img_release();
+    g_geo = geo;
+    if (ncache && cache_alloc(ncache) != 0) { free(p); close(fd); return -1; }
+    img_set_base((uint8_t *)p);
+    img_fd = fd;
+    img_set_path(filename, 1);
+    if (bm_attach() != 0) return -1;
+    size_t tab = (size_t)g_geo.count * sizeof(uint32_t);
+    if (ctab && in_read(fd, g_geo.ctab_off, ctab, tab) != 0) return -1;
+    if (csum && (in_read(fd, g_geo.csum_off, csum, tab) != 0 || csum_load_done() != 0)) return -1;
+    return jrnl_replay();
+}
+
+int block_save_image(const char *filename)
 {
-  // memset(block_data, 0, sizeof(block_data));
-  // memset(block_bitmap, 0, sizeof(block_bitmap));
-  return 0;
+    if (!img_base || !filename) return -1;
+    zero_flush();
+
+    /* mapped from this very file: log what is still open, then checkpoint */
+    if (img_current && img_fd >= 0 && strcmp(img_path, filename) == 0) {
+        if (block_commit() != 0) return -1;
+        return img_checkpoint();
+    }
+
+    /* fresh disk (or save-as): sparse file with the used blocks, then run off it */
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    int rc = 0;
+    if (ftruncate(fd, (off_t)g_geo.img_size) != 0) rc = -1;
+    if (rc == 0) rc = img_write_all(fd);
+    if (rc == 0 && fsync(fd) != 0) rc = -1;
+    close(fd);
+    if (rc != 0) return -1;
+
+    return block_load_image(filename);
 }
 
-#include <stdio.h>
-#include <string.h>
-#include <stdint.h>
+/* only a block whose bytes the image file has alone takes real IO; the
+ * rest is in memory and completes on the spot */
+int block_submit_read(int blkno, void *buf)
+{
+    if (!buf || !blkno_valid(blkno)) return -1;
 
-#include "block.h"
+    uint64_t b = (uint64_t)blkno;
+    if (img_fd < 0 || bit_test(dirty_blocks, b) || bit_test(zero_blocks, b) ||
+        comp_packed(b) || (cache_n && cache_find(b) >= 0))
+        return block_read(blkno, buf);
 
-static uint8_t block_data[BLOCK_COUNT][BLOCK_SIZE];
-static uint8_t block_bitmap[BLOCK_COUNT]; /* 0 free, 1 used */
+    if (bit_test(sub_blocks, b)) ioq_settle(); /* its submitted write lands first */
+    return ioq_read_blocks(img_fd, b, buf, g_geo.bsize);
+}
 
-#define IMG_MAGIC 0x56465331u /* 'VFS1' */
+/* a block new since the checkpoint goes straight into its slot, the way
+ * a checkpoint would put it there, and never through the journal: the
+ * committed image doesn't use the slot, and block_commit waits for the
+ * write before logging anything that refers to it. anything else lands
+ * in the block store like block_write */
+int block_submit_write(int blkno, const void *buf)
+{
+    if (!buf || !blkno_valid(blkno)) return -1;
 
-typedef struct {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t block_count;
-    uint32_t reserved;
-} img_hdr_t;
+    uint64_t b = (uint64_t)blkno;
+    if (img_fd < 0 || ctab || !bit_test(fresh_blocks, b) || bit_test(punch_blocks, b) ||
+        bit_test(dirty_blocks, b))
+        return block_write(blkno, buf);
 
-int block_reserve(int blkno)
+    size_t bs = g_geo.bsize;
+    if (bit_test(sub_blocks, b)) ioq_settle(); /* one write of a slot at a time */
+    if (cache_n) {
+        int i = cache_find(b);
+        if (i >= 0) memcpy(cache_mem + (size_t)i * bs, buf, bs);
+    } else {
+        memcpy(block_data + (size_t)b * bs, buf, bs);
+    }
+    bit_clear(zero_blocks, b);
+    if (dd_live) bit_clear(dd_live, b);
+    if (csum) csum_note(b, (const uint8_t *)buf);
+
+    bit_set(sub_blocks, b);
+    if (sub_hi == sub_lo) sub_lo = b;
+    if (b < sub_lo) sub_lo = b;
+    if (b >= sub_hi) sub_hi = b + 1;
+    sub_csum = 1;
+    return ioq_write(img_fd, blk_off(b), buf, bs);
+}
+
+int block_poll(int wait)
+{
+    if (wait) return ioq_drain();
+
+    if (ioq_inflight > 0 && ioq_enter(0) != 0) return -1;
+    if (ioq_inflight == 0) sub_clear();
+    if (ioq_failed) {
+        ioq_failed = 0;
+        return -1;
+    }
+    return ioq_inflight;
+}
+
+void block_submit_buffer(void *buf, size_t len)
+{
+    ioq_register(IOQ_BUF_SUBMIT, (uint8_t *)buf, len);
+}
+
+#else /* _WIN32: no mmap, keep the image in heap memory */
+
+/* no journal here: saves write the dirty ranges straight into the image */
+static int jrnl_active(void)
 {
-    if (blkno < 0 || blkno >= (int)BLOCK_COUNT) return -1;
-    block_bitmap[blkno] = 1;
     return 0;
 }
 
-int block_save_image(const char *filename)
+size_t block_log_capacity(void)
 {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) return -1;
+    return 0;
+}
 
-    img_hdr_t hdr;
-    memset(&hdr, 0, sizeof(hdr));
-    hdr.magic = IMG_MAGIC;
-    hdr.block_size = BLOCK_SIZE;
-    hdr.block_count = BLOCK_COUNT;
+size_t block_pending(void)
+{
+    return 0;
+}
+
+int block_commit(void)
+{
+    return 0;
+}
+
+/* the heap image holds every block already */
+static uint8_t *cache_get(uint64_t b, int fill)
+{
+    (void)b; (void)fill;
+    return NULL;
+}
 
-    /* header */
-    if (fwrite(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) { fclose(fp); return -1; }
+static void cache_pin(uint64_t b, int wr)
+{
+    (void)b; (void)wr;
+}
+
+static int cache_unpin(uint64_t b)
+{
+    (void)b;
+    return 0;
+}
 
-    /* bitmap */
-    if (fwrite(block_bitmap, 1, BLOCK_COUNT, fp) != BLOCK_COUNT) { fclose(fp); return -1; }
+static int cache_read_run(uint64_t b, uint64_t n, uint8_t *dst, size_t bytes)
+{
+    (void)b; (void)n; (void)dst; (void)bytes;
+    return -1;
+}
 
-    /* data blocks */
-    size_t total = (size_t)BLOCK_COUNT * (size_t)BLOCK_SIZE;
-    if (fwrite(block_data, 1, total, fp) != total) { fclose(fp); return -1; }
+/* everything is in memory: requests complete as they are submitted */
+int block_submit_read(int blkno, void *buf)
+{
+    return block_read(blkno, buf);
+}
 
-    fclose(fp);
+int block_submit_write(int blkno, const void *buf)
+{
+    return block_write(blkno, buf);
+}
+
+int block_poll(int wait)
+{
+    (void)wait;
     return 0;
 }
 
+void block_submit_buffer(void *buf, size_t len)
+{
+    (void)buf; (void)len;
+}
+
+int block_format(size_t block_size, uint64_t block_count)
+{
+    if (!geometry_valid(block_size, block_count)) return -1;
+
+    free(img_base);
+    img_base = NULL;
+    img_path[0] = '\0';
+    img_current = 0;
+    geometry_set(&g_geo, block_size, block_count);
+
+    uint8_t *p = (uint8_t *)calloc(1, g_geo.map_size);
+    if (!p) return -1;
+
+    img_set_base(p);
+    img_fill_header();
+    return bm_attach();
+}
+
 int block_load_image(const char *filename)
 {
     FILE *fp = fopen(filename, "rb");
@@ -78,40 +2417,333 @@ int block_load_image(const char *filename)
         return -1;
     }
 
-    img_hdr_t hdr;
-    if (fread(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) { fclose(fp); return -1; }
-
-    if (hdr.magic != IMG_MAGIC ||
-        hdr.block_size != BLOCK_SIZE ||
-        hdr.block_count != BLOCK_COUNT) {
+    uint8_t raw[sizeof(img_hdr_t)];
+    memset(raw, 0, sizeof(raw));
+    img_geom_t geo;
+    size_t got = fread(raw, 1, sizeof(raw), fp);
+    if (got < sizeof(img_hdr_v1_t) || geometry_from_header(&geo, raw, got) != 0) { fclose(fp); return -1; }
+    if (geo.byte_bitmap) {
         fclose(fp);
-        return -1;
+        return img_convert_legacy(filename, &geo);
     }
+    if (geo.ctab_off) { fclose(fp); return -1; } /* packed blocks need the cache */
 
-    if (fread(block_bitmap, 1, BLOCK_COUNT, fp) != BLOCK_COUNT) { fclose(fp); return -1; }
+    /* header and bitmap, then only the used runs: free blocks stay zero */
+    uint8_t *p = (uint8_t *)calloc(1, geo.map_size);
+    if (!p) { fclose(fp); return -1; }
+    if (fseek(fp, 0, SEEK_SET) != 0 ||
+        fread(p, 1, geo.data_off, fp) != geo.data_off) { free(p); fclose(fp); return -1; }
 
-    size_t total = (size_t)BLOCK_COUNT * (size_t)BLOCK_SIZE;
-    if (fread(block_data, 1, total, fp) != total) { fclose(fp); return -1; }
+    const uint64_t *bits = (const uint64_t *)(p + geo.bitmap_off);
+    uint64_t s, n, pos = 0;
+    while (next_run(bits, pos, geo.count, &s, &n)) {
+        size_t off = geo.data_off + (size_t)s * geo.bsize, len = (size_t)n * geo.bsize;
+        if (_fseeki64(fp, (long long)off, SEEK_SET) != 0 ||
+            fread(p + off, 1, len, fp) != len) { free(p); fclose(fp); return -1; }
+        pos = s + n;
+    }
 
+    free(img_base);
+    g_geo = geo;
+    img_set_base(p);
+    img_set_path(filename, 1);
+    int rc = bm_attach();
+    size_t tab = (size_t)g_geo.count * sizeof(uint32_t);
+    if (rc == 0 && csum && (_fseeki64(fp, (long long)g_geo.csum_off, SEEK_SET) != 0 ||
+                            fread(csum, 1, tab, fp) != tab || csum_load_done() != 0)) rc = -1;
     fclose(fp);
+    return rc;
+}
+
+int block_save_image(const char *filename)
+{
+    if (!img_base || !filename) return -1;
+    zero_flush();
+
+    int incremental = (img_current && strcmp(img_path, filename) == 0);
+    FILE *fp = fopen(filename, incremental ? "r+b" : "wb");
+    if (!fp) return -1;
+
+    int rc;
+    if (incremental) {
+        rc = img_write_dirty(fp);
+    } else {
+        /* size the file first so trailing free blocks exist too */
+        uint8_t zero = 0;
+        rc = out_write(fp, g_geo.img_size - 1, &zero, 1);
+        if (rc == 0) rc = img_write_all(fp);
+    }
+    if (fclose(fp) != 0) rc = -1;
+    if (rc != 0) return -1;
+
+    img_set_path(filename, 1);
+    dirty_clear();
+    return 0;
+}
+
+#endif /* _WIN32 */
+
+int block_sync(void)
+{
+    char path[sizeof(img_path)];
+
+    if (img_path[0] == '\0') return -1; /* never saved, no image yet */
+    memcpy(path, img_path, sizeof(path)); /* a save may remap and reset img_path */
+    return block_save_image(path);
+}
+
+/* ---------- scrub ----------
+ * every used block read back from the image and checked against its
+ * checksum. workers take SCRUB_CHUNK blocks at a time off a shared
+ * counter; the rest of the device stands still meanwhile. */
+#define SCRUB_CHUNK   256
+#define SCRUB_THREADS 8
+
+typedef struct {
+    uint64_t        next;   /* first block nobody took yet */
+    block_scrub_t  *r;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} scrub_job_t;
+
+/* block b as stored into out: 0 ok, -1 unreadable or corrupt */
+static int scrub_block(uint64_t b, uint8_t *in, uint8_t *out)
+{
+    size_t bs = g_geo.bsize;
+#ifndef _WIN32
+    size_t off = g_geo.data_off + (size_t)b * bs;
+    if (comp_packed(b)) {
+        if (ctab[b] >= bs || in_read(img_fd, off, in, ctab[b]) != 0 ||
+            lz_decompress(in, ctab[b], out, bs) != 0) return -1;
+    } else if (in_read(img_fd, off, out, bs) != 0) {
+        return -1;
+    }
+#else
+    /* the heap copy is what was read at mount */
+    (void)in;
+    memcpy(out, block_data + (size_t)b * bs, bs);
+#endif
+    return crc32c(0, out, bs) == csum[b] ? 0 : -1;
+}
+
+static void *scrub_worker(void *arg)
+{
+    scrub_job_t *job = (scrub_job_t *)arg;
+    uint8_t *buf = (uint8_t *)malloc(2 * g_geo.bsize);
+    size_t checked = 0;
+
+    for (;;) {
+        uint64_t from = __atomic_fetch_add(&job->next, SCRUB_CHUNK, __ATOMIC_RELAXED);
+        if (from >= g_geo.count) break;
+        uint64_t to = from + SCRUB_CHUNK < g_geo.count ? from + SCRUB_CHUNK : g_geo.count;
+
+        for (uint64_t b = from; b < to; b++) {
+            /* changed since the checkpoint: neither the image nor its
+             * checksum has the new bytes yet */
+            if (!bm_test(b) || bit_test(zero_blocks, b) || bit_test(dirty_blocks, b)) continue;
+            checked++;
+            if (buf && scrub_block(b, buf, buf + g_geo.bsize) == 0) continue;
+
+#ifndef _WIN32
+            pthread_mutex_lock(&job->lock);
+#endif
+            block_scrub_t *r = job->r;
+            if (r->bad < sizeof(r->bad_blocks) / sizeof(r->bad_blocks[0]))
+                r->bad_blocks[r->bad] = (int)b;
+            r->bad++;
+#ifndef _WIN32
+            pthread_mutex_unlock(&job->lock);
+#endif
+        }
+    }
+    __atomic_fetch_add(&job->r->checked, checked, __ATOMIC_RELAXED);
+    free(buf);
+    return NULL;
+}
+
+int block_scrub(block_scrub_t *r)
+{
+    if (!r) return -1;
+    memset(r, 0, sizeof(*r));
+    if (!csum_loaded) return -1; /* no checksums, or the image was never saved */
+
+    scrub_job_t job;
+    job.next = 0;
+    job.r = r;
+    crc32c_init();
+#ifndef _WIN32
+    ioq_settle(); /* writes still in flight would race the reads */
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus < 1 ? 1 : (cpus > SCRUB_THREADS ? SCRUB_THREADS : (int)cpus);
+    pthread_t tid[SCRUB_THREADS];
+
+    int started = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&tid[started], NULL, scrub_worker, &job) == 0) started++;
+    }
+    if (started == 0) scrub_worker(&job); /* no threads: do it here */
+    for (int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    r->threads = started ? started : 1;
+#else
+    r->threads = 1;
+    scrub_worker(&job);
+#endif
+    return 0;
+}
+
+size_t block_csum_errors(void)
+{
+    return csum_errors;
+}
+
+void block_set_cache(size_t nblocks)
+{
+    if (nblocks && nblocks < BLOCK_CACHE_MIN) nblocks = BLOCK_CACHE_MIN;
+    cache_want = nblocks;
+}
+
+void block_set_compress(int on)
+{
+#ifndef _WIN32
+    comp_want = on != 0;
+#else
+    (void)on; /* no buffer cache here to unpack into */
+#endif
+}
+
+int block_compress_enabled(void)
+{
+    return ctab != NULL;
+}
+
+int block_init(void)
+{
+    if (img_base) return 0; /* already loaded or formatted */
+    return block_format(BLOCK_SIZE_DEFAULT, BLOCK_COUNT_DEFAULT);
+}
+
+int block_reserve(int blkno)
+{
+    if (!blkno_valid(blkno)) return -1;
+    bm_set((uint64_t)blkno);
+    return 0;
+}
+
+int block_claim(int blkno)
+{
+    if (!blkno_valid(blkno)) return -1;
+
+    uint64_t b = (uint64_t)blkno;
+    if (ref_claimed && bit_test(ref_claimed, b)) return ref_add(b);
+    if (ref_claimed) bit_set(ref_claimed, b);
+    bm_set(b);
     return 0;
 }
 
+int block_ref(int blkno)
+{
+    if (!blkno_valid(blkno) || !bm_test((uint64_t)blkno)) return -1;
+    return ref_add((uint64_t)blkno);
+}
+
+int block_refcount(int blkno)
+{
+    if (!blkno_valid(blkno) || !bm_test((uint64_t)blkno)) return 0;
+    ref_slot_t *r = ref_find((uint64_t)blkno);
+    return r ? 1 + (int)r->extra : 1;
+}
+
+/* copy on write: the block a writer may change in place */
+int block_cow(int blkno)
+{
+    if (block_refcount(blkno) <= 1) return blkno;
+
+    int got;
+    int nb = block_alloc_extent(blkno, 1, &got);
+    if (nb < 0) return -1;
+
+    const void *src = block_get(blkno, BLOCK_RD);
+    void *dst = src ? block_get(nb, BLOCK_NEW) : NULL;
+    if (dst) memcpy(dst, src, g_geo.bsize);
+    if (dst) block_put(nb);
+    if (src) block_put(blkno);
+    if (!dst) {
+        block_free(nb);
+        return -1;
+    }
+
+    ref_drop((uint64_t)blkno);
+    return nb;
+}
+
+void block_set_dedup(int on)
+{
+    dd_want = on != 0;
+}
+
+int block_dedup_enabled(void)
+{
+    return dd_want;
+}
+
+int block_dedup(const void *buf, size_t len)
+{
+    if (!dd_want || !dd_tab || (!buf && len > 0) || len > g_geo.bsize) return -1;
+
+    const uint8_t *want = dd_block(buf, len);
+    dd_slot_t *d = dd_slot(dd_hash(want, g_geo.bsize));
+    if (!dd_valid(d)) return -1;
+
+    const uint8_t *have = blk_get((uint64_t)d->blk);
+    if (!have || memcmp(have, want, g_geo.bsize) != 0) return -1;
+    if (ref_add((uint64_t)d->blk) != 0) return -1;
+    return (int)d->blk;
+}
+
+void block_dedup_index(int blkno)
+{
+    if (!dd_want || !blkno_valid(blkno) || !bm_test((uint64_t)blkno)) return;
+
+    if (!dd_live) {
+        dd_live = (uint64_t *)calloc(1, bitmap_bytes(g_geo.count));
+        dd_tmp  = (uint8_t *)malloc(g_geo.bsize);
+        if (!dd_live || !dd_tmp) { dd_reset(); return; }
+    }
+    if (dd_grow() != 0) return;
+
+    const uint8_t *p = blk_get((uint64_t)blkno);
+    if (!p) return;
+
+    uint64_t hash = dd_hash(p, g_geo.bsize);
+    dd_slot_t *d = dd_slot(hash);
+    if (d->blk < 0) dd_used++;
+    d->hash = hash;
+    d->blk = blkno;
+    bit_set(dd_live, (uint64_t)blkno);
+}
+
+size_t block_shared_blocks(void)
+{
+    return ref_extra;
+}
+
+size_t block_size(void)
+{
+  return g_geo.bsize;
+}
 
 size_t block_total_blocks(void)
 {
-  return (size_t)BLOCK_COUNT;
+  return (size_t)g_geo.count;
 }
 
 size_t block_used_blocks(void)
 {
-  size_t used = 0;
-  for(size_t i = 0; i < BLOCK_COUNT; i++)
-  {
-    if (block_bitmap[i])
-    used++;
- }
-  return used;
+  return (size_t)bm_used;
 }
 
 size_t block_free_blocks(void)
@@ -121,55 +2753,288 @@ size_t block_free_blocks(void)
 
 size_t block_total_size(void)
 {
-  return (size_t)BLOCK_COUNT * (size_t)BLOCK_SIZE;
+  return (size_t)g_geo.count * g_geo.bsize;
 }
 
 size_t block_used_size(void)
 {
-  return block_used_blocks() * (size_t)BLOCK_SIZE;
+  return block_used_blocks() * g_geo.bsize;
 }
 
 size_t block_free_size(void)
 {
-  return block_free_blocks() * (size_t)BLOCK_SIZE;
+  return block_free_blocks() * g_geo.bsize;
+}
+
+/* what the image file takes on the host: holes don't count */
+size_t block_image_size(void)
+{
+#ifndef _WIN32
+  struct stat st;
+  if (img_fd >= 0 && fstat(img_fd, &st) == 0) return (size_t)st.st_blocks * 512;
+#endif
+  return 0;
 }
 
 int block_alloc(void)
 {
-    for (int i = 0; i < BLOCK_COUNT; i++)
-    {
-        if (block_bitmap[i] == 0)
-        {
-            block_bitmap[i] = 1;
-            memset(block_data[i], 0, BLOCK_SIZE);
-            return i;
+    int64_t b = bm_find_free(0);
+    if (b < 0) return -1; /* full */
+
+    bm_set((uint64_t)b);
+    bit_set(zero_blocks, (uint64_t)b);
+    bit_set(fresh_blocks, (uint64_t)b);
+    return (int)b;
+}
+
+int block_groups(void)
+{
+    return (int)grp_n;
+}
+
+int block_group_info(int group, block_group_t *out)
+{
+    if (!out || group < 0 || (size_t)group >= grp_n) return -1;
+
+    uint64_t first = (uint64_t)group << grp_shift;
+    uint64_t end   = first + (1ull << grp_shift);
+    if (end > g_geo.count) end = g_geo.count;
+
+    out->first  = (int)first;
+    out->blocks = (int)(end - first);
+    out->free   = (int)grp_free[group];
+    return 0;
+}
+
+/* directories spread over the groups by a key of their own (the same on
+ * every mount, nothing of this is stored) */
+int block_group_of(uint64_t key)
+{
+    return grp_n ? (int)(key % grp_n) : 0;
+}
+
+int block_group_goal(int group)
+{
+    if (grp_n == 0) return 0;
+    if (group < 0 || (size_t)group >= grp_n) group = 0;
+
+    /* a full group sends the search on to the next one with room */
+    for (size_t i = 0; i < grp_n; i++) {
+        size_t g = ((size_t)group + i) % grp_n;
+        if (grp_free[g]) return (int)(g << grp_shift);
+    }
+    return 0;
+}
+
+void block_frag(block_frag_t *r)
+{
+    if (!r) return;
+    memset(r, 0, sizeof(*r));
+
+    int64_t f = bm_next_free(0);
+    while (f >= 0) {
+        uint64_t len = bm_run_len((uint64_t)f, g_geo.count);
+        int k = 63 - __builtin_clzll(len);
+        if (k >= BLOCK_FRAG_BUCKETS) k = BLOCK_FRAG_BUCKETS - 1;
+
+        r->hist[k]++;
+        r->runs++;
+        if (len > r->largest) r->largest = (size_t)len;
+        f = bm_next_free((uint64_t)f + len);
+    }
+}
+
+/* Contiguous allocation: look for n free blocks in a row, starting at goal
+ * and wrapping once. When no run is that long, hand out the longest one
+ * seen; *got tells the caller how many it received. */
+int block_alloc_extent(int goal, int n, int *got)
+{
+    if (!got || n <= 0) return -1;
+    *got = 0;
+    if (!blkno_valid(goal)) goal = 0;
+
+    uint64_t best = 0, best_len = 0;
+    int done = 0;
+
+    for (int pass = 0; pass < 2 && !done; pass++) {
+        uint64_t pos = pass ? 0 : (uint64_t)goal;
+        uint64_t end = pass ? (uint64_t)goal : g_geo.count;
+
+        while (pos < end) {
+            int64_t f = bm_next_free(pos);
+            if (f < 0 || (uint64_t)f >= end) break;
+
+            uint64_t len = bm_run_len((uint64_t)f, (uint64_t)n);
+            if (len > best_len) {
+                best = (uint64_t)f;
+                best_len = len;
+                if (len >= (uint64_t)n) { done = 1; break; }
+            }
+            pos = (uint64_t)f + len;
         }
     }
-    return -1; /* full */
+    if (best_len == 0) return -1; /* full */
+
+    bm_set_range(best, best_len, 1);
+    for (uint64_t b = best; b < best + best_len; b++) {
+        bit_set(zero_blocks, b);
+        bit_set(fresh_blocks, b);
+    }
+
+    *got = (int)best_len;
+    return (int)best;
+}
+
+void block_free_extent(int start, int len)
+{
+    if (len <= 0 || !blkno_valid(start) || !blkno_valid(start + len - 1))
+        return;
+
+    for (int b = start; b < start + len; b++) block_free(b);
 }
 
 void block_free(int blkno)
 {
-    if (blkno < 0 || blkno >= BLOCK_COUNT)
+    if (!blkno_valid(blkno) || !bm_test((uint64_t)blkno))
         return;
+    if (ref_drop((uint64_t)blkno)) return; /* another file still has it */
 
-    block_bitmap[blkno] = 0;
-    memset(block_data[blkno], 0, BLOCK_SIZE);
+    bm_clear((uint64_t)blkno);
+    bit_clear(zero_blocks, (uint64_t)blkno);
+    /* nothing left worth writing home, the next checkpoint punches it */
+    bit_clear(dirty_blocks, (uint64_t)blkno);
+    bit_set(punch_blocks, (uint64_t)blkno);
+    if (dd_live) bit_clear(dd_live, (uint64_t)blkno);
 }
 
 int block_read(int blkno, void *buf)
 {
     if (!buf) return -1;
-    if (blkno < 0 || blkno >= (int)BLOCK_COUNT) return -1;
-    memcpy(buf, block_data[blkno], BLOCK_SIZE);
+    if (!blkno_valid(blkno)) return -1;
+    const uint8_t *p = blk_get((uint64_t)blkno);
+    if (!p) return -1;
+    memcpy(buf, p, g_geo.bsize);
+    return 0;
+}
+
+/* Zero-copy access: a pointer straight into the block store, valid until
+ * block_put(). BLOCK_WR / BLOCK_NEW mark the block dirty; with BLOCK_NEW
+ * the old contents are not read, the caller fills the whole block. */
+void *block_get(int blkno, int flags)
+{
+    if (!blkno_valid(blkno)) return NULL;
+
+    int wr = (flags & (BLOCK_WR | BLOCK_NEW)) != 0;
+    uint8_t *p = (flags & BLOCK_NEW) ? blk_new((uint64_t)blkno) : blk_get((uint64_t)blkno);
+    if (!p) return NULL;
+
+    if (cache_n) cache_pin((uint64_t)blkno, wr);
+    if (wr) dirty_block((uint64_t)blkno);
+    return p;
+}
+
+void block_put(int blkno)
+{
+    if (!blkno_valid(blkno) || !cache_n) return;
+
+    /* an early commit may have logged it half written: log it again */
+    if (cache_unpin((uint64_t)blkno)) dirty_block((uint64_t)blkno);
+}
+
+/* how many of blk[i..] form one run: consecutive blocks whose buffers
+ * are full and back to back. 0 if blk[i] / iov[i] is bad */
+static int vec_run(const int *blk, const block_iov_t *iov, int i, int cnt, size_t *bytes)
+{
+    size_t bs = g_geo.bsize;
+    if (!blkno_valid(blk[i]) || iov[i].len > bs || (!iov[i].base && iov[i].len)) return 0;
+
+    int j = i + 1;
+    *bytes = iov[i].len;
+    while (j < cnt && iov[j - 1].len == bs && blk[j] == blk[j - 1] + 1 &&
+           blkno_valid(blk[j]) && iov[j].len > 0 && iov[j].len <= bs &&
+           (uint8_t *)iov[j].base == (uint8_t *)iov[j - 1].base + bs) {
+        *bytes += iov[j].len;
+        j++;
+    }
+    return j - i;
+}
+
+int block_readv(const int *blk, const block_iov_t *iov, int cnt)
+{
+    if (!blk || !iov || cnt < 0) return -1;
+
+    for (int i = 0; i < cnt; ) {
+        size_t bytes;
+        int n = vec_run(blk, iov, i, cnt, &bytes);
+        if (n == 0) return -1;
+
+        uint64_t b = (uint64_t)blk[i];
+        /* never-written blocks get their zeroes before the bulk copy */
+        for (int k = 0; k < n; k++) {
+            if (bit_test(zero_blocks, b + (uint64_t)k) && !blk_get(b + (uint64_t)k)) return -1;
+        }
+        if (bytes == 0) {
+            /* nothing to move */
+        } else if (cache_n) {
+            if (cache_read_run(b, (uint64_t)n, (uint8_t *)iov[i].base, bytes) != 0) return -1;
+        } else {
+            for (int k = 0; csum_seen && k < n; k++) {
+                uint64_t c = b + (uint64_t)k;
+                if (!bit_test(csum_seen, c) && csum_touch(c, block_data + (size_t)c * g_geo.bsize) != 0)
+                    return -1;
+            }
+            memcpy(iov[i].base, block_data + (size_t)b * g_geo.bsize, bytes);
+        }
+        i += n;
+    }
+    return 0;
+}
+
+int block_writev(const int *blk, const block_iov_t *iov, int cnt)
+{
+    if (!blk || !iov || cnt < 0) return -1;
+
+    size_t bs = g_geo.bsize;
+    for (int i = 0; i < cnt; ) {
+        size_t bytes;
+        int n = vec_run(blk, iov, i, cnt, &bytes);
+        if (n == 0) return -1;
+
+        uint64_t b = (uint64_t)blk[i];
+        const uint8_t *src = (const uint8_t *)iov[i].base;
+        if (!cache_n) {
+            uint8_t *d = block_data + (size_t)b * bs;
+            if (bytes) memcpy(d, src, bytes);
+            memset(d + bytes, 0, (size_t)n * bs - bytes);
+            for (int k = 0; k < n; k++) {
+                bit_clear(zero_blocks, b + (uint64_t)k);
+                dirty_block(b + (uint64_t)k);
+            }
+        } else {
+            /* the cache holds them one by one, the journal needs them there */
+            for (int k = 0; k < n; k++) {
+                size_t off = (size_t)k * bs;
+                size_t len = bytes - off < bs ? bytes - off : bs;
+                uint8_t *d = blk_new(b + (uint64_t)k);
+                if (!d) return -1;
+                if (len) memcpy(d, src + off, len);
+                memset(d + len, 0, bs - len);
+                dirty_block(b + (uint64_t)k);
+            }
+        }
+        i += n;
+    }
     return 0;
 }
 
 int block_write(int blkno, const void *buf)
 {
     if (!buf) return -1;
-    if (blkno < 0 || blkno >= (int)BLOCK_COUNT) return -1;
-    memcpy(block_data[blkno], buf, BLOCK_SIZE);
+    if (!blkno_valid(blkno)) return -1;
+    uint8_t *d = blk_new((uint64_t)blkno);
+    if (!d) return -1;
+    memcpy(d, buf, g_geo.bsize);
+    dirty_block((uint64_t)blkno);
     return 0;
 }
 
@@ -4,18 +4,26 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define BLOCK_SIZE     512          /* bytes per block */
-#define BLOCK_COUNT    1024         /* total blocks (512 KB total) */
+/* geometry comes from the image header; these only bound / seed it */
+#define BLOCK_SIZE_MIN      512
+#define BLOCK_SIZE_MAX      65536       /* largest block, sizes stack buffers */
+#define BLOCK_SIZE_DEFAULT  4096        /* one page */
+#define BLOCK_COUNT_DEFAULT 1024        /* 4 MB with default blocks */
+#define BLOCK_CACHE_MIN     64          /* smallest buffer cache, in blocks */
+#define BLOCK_CACHE_COMPRESS 1024       /* cache for a compressed image loaded without one */
 
 
 // Init / info
-int  block_init(void);
+int  block_init(void);               /* default geometry if nothing mounted */
+int  block_format(size_t block_size, uint64_t block_count); /* fresh device */
+size_t block_size(void);            /* bytes per block */
 size_t block_total_size(void);      /* total bytes */
 size_t block_used_size(void);       /* used bytes */
 size_t block_free_size(void);       /* free bytes */
 size_t block_total_blocks(void);
 size_t block_used_blocks(void);
 size_t block_free_blocks(void);
+size_t block_image_size(void);      /* bytes the image file holds on the host, 0 if unknown */
 int block_load_image(const char *filename);
 int block_save_image(const char *filename);
 
@@ -23,13 +31,96 @@ int block_save_image(const char *filename);
 int  block_alloc(void);              /* return block index, -1 if full */
 void block_free(int blkno);
 int  block_reserve(int blkno); 
+int  block_alloc_extent(int goal, int n, int *got); /* run of up to n, start or -1 */
+void block_free_extent(int start, int len);
+
+// Allocation groups: the device in equal runs of blocks, each with its own
+// part of the bitmap and free count; files start in their directory's group
+typedef struct {
+    int first;   /* first block */
+    int blocks;
+    int free;
+} block_group_t;
+int  block_groups(void);
+int  block_group_info(int group, block_group_t *out);
+int  block_group_of(uint64_t key);   /* home group of a directory, from a number stable for it */
+int  block_group_goal(int group);    /* allocation goal in it, or the next group with room */
+
+// Free space layout: runs of free blocks by size, bucket i holds the runs
+// of 2^i .. 2^(i+1)-1 blocks (the last one everything longer)
+#define BLOCK_FRAG_BUCKETS 16
+typedef struct {
+    size_t runs;
+    size_t largest;
+    size_t hist[BLOCK_FRAG_BUCKETS];
+} block_frag_t;
+void block_frag(block_frag_t *r);
+
+// Sharing (reflink): block_free drops one owner, the last one frees it
+int  block_ref(int blkno);           /* one more owner, -1 if not allocated */
+int  block_refcount(int blkno);      /* 0 free, 1 exclusive, >1 shared */
+int  block_cow(int blkno);           /* blkno if exclusive, else a private copy of it; -1 on error */
+int  block_claim(int blkno);         /* mount: an owner found in the metadata */
+size_t block_shared_blocks(void);    /* owners beyond the first, summed: logical - physical */
+
+// Dedup (opt-in): a file block whose bytes some block already holds
+// shares that block instead of taking a new one
+void block_set_dedup(int on);
+int  block_dedup_enabled(void);
+int  block_dedup(const void *buf, size_t len); /* block holding buf (zero-filled past len), one more owner; -1 if none */
+void block_dedup_index(int blkno);   /* blkno holds file data now, offer it for sharing */
 
 // IO
 int  block_read(int blkno, void *buf);
 int  block_write(int blkno, const void *buf);
 
-int block_load_image(const char *path);  /* disk.img -> memory */
-int block_save_image(const char *path);  /* memory -> disk.img */
+// Zero-copy IO: pinned pointer into the block store until block_put()
+#define BLOCK_RD   0x0  /* read only */
+#define BLOCK_WR   0x1  /* modify in place, marks the block dirty */
+#define BLOCK_NEW  0x2  /* overwrite all of it: old contents not read */
+void *block_get(int blkno, int flags);
+void  block_put(int blkno);
+
+// Vectored IO: one buffer per block; adjacent blocks in back-to-back
+// buffers move as one copy / one read
+typedef struct {
+    void   *base;
+    size_t  len;    /* bytes, at most one block */
+} block_iov_t;
+int  block_readv(const int *blknos, const block_iov_t *iov, int cnt);
+int  block_writev(const int *blknos, const block_iov_t *iov, int cnt); /* zero-fills each block past len */
+
+// Async IO: submit, then poll. buf belongs to the request until block_poll
+// says it is done; reads of blocks the image file alone has, and writes of
+// blocks new since the last checkpoint, are in flight together (io_uring
+// where available), the rest completes at submit
+int  block_submit_read(int blkno, void *buf);
+int  block_submit_write(int blkno, const void *buf);
+int  block_poll(int wait);   /* requests in flight, 0 = all done; -1 if any failed */
+void block_submit_buffer(void *buf, size_t len); /* pin the buffers submits use, NULL unpins */
+
+void block_set_cache(size_t nblocks);    /* >0: next load caches this many blocks instead of mapping */
+void block_set_compress(int on);         /* new images (and v4 ones on load) store blocks LZ-packed */
+int  block_compress_enabled(void);       /* this image stores blocks packed (blocks over a page only) */
+int block_load_image(const char *path);  /* map disk.img as the device, replay its journal */
+int block_save_image(const char *path);  /* checkpoint dirty ranges, or a fresh disk.img */
+int block_sync(void);                    /* save to the image in use */
+
+// Integrity: a crc32c per block (images made since v5), checked when a
+// block is read back from the image
+typedef struct {
+    size_t checked;        /* used blocks read back */
+    size_t bad;            /* mismatched or unreadable */
+    int    bad_blocks[16]; /* the first of them */
+    int    threads;
+} block_scrub_t;
+int    block_scrub(block_scrub_t *r);  /* check every used block, in parallel; -1 if the image has no checksums */
+size_t block_csum_errors(void);        /* mismatches reads ran into since mount */
+
+// Journal (redo log after the data blocks)
+int    block_commit(void);        /* log all changes since the last commit, one fsync */
+size_t block_pending(void);       /* log bytes the next commit takes, 0 if nothing changed */
+size_t block_log_capacity(void);  /* 0 when the image has no journal */
 
 
 
@@ -0,0 +1,898 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bmap.h"
+#include "block.h"
+#include "inode.h"
+
+#define MAP_LEVELS 3  /* single, double, triple indirect */
+
+/* extent mode (INODE_EXTENTS): i_block[0] is a header, count | depth << 16.
+ * depth 0: up to EXT_INLINE (logical, start, len) triples follow in place.
+ * depth 1: up to EXT_INDEX (logical, leaf) pairs, each leaf block a count
+ * then triples. lookups are a binary search on logical */
+#define EXT_INLINE 4
+#define EXT_INDEX  7
+
+/* block numbers per indirect block */
+static size_t per_block(void)
+{
+    return block_size() / sizeof(int32_t);
+}
+
+/* ---------- map block cache ----------
+ * one decoded indirect block per depth (0 = points at data). walking a
+ * file in order stays on the same one for `per` blocks, so resolving an
+ * offset is an index into memory, not a block read. key is blkno + 1,
+ * 0 empty; bmap is the only writer of map blocks, so it keeps them exact. */
+typedef struct {
+    int     key;
+    int32_t ent[BLOCK_SIZE_MAX / sizeof(int32_t)];
+} map_cache_t;
+
+static map_cache_t map_cache[MAP_LEVELS];
+
+void bmap_reset(void)
+{
+    for (int d = 0; d < MAP_LEVELS; d++) map_cache[d].key = 0;
+}
+
+static void map_forget(int blk)
+{
+    for (int d = 0; d < MAP_LEVELS; d++) {
+        if (map_cache[d].key == blk + 1) map_cache[d].key = 0;
+    }
+}
+
+/* map block blk decoded in the slot for depth, NULL if unreadable; valid
+ * until the next lookup at that depth */
+static const int32_t *map_block(int depth, int blk)
+{
+    map_cache_t *c = &map_cache[depth];
+
+    if (blk < 0) return NULL;
+    if (c->key != blk + 1) {
+        c->key = 0;
+        if (block_read(blk, c->ent) != 0) return NULL;
+        c->key = blk + 1;
+    }
+    return c->ent;
+}
+
+static int map_entry(int depth, int blk, size_t i)
+{
+    const int32_t *ent = map_block(depth, blk);
+    return ent ? ent[i] : -1;
+}
+
+/* ---------- extents ---------- */
+static int is_ext(const struct inode *inode)
+{
+    return (inode->i_flags & INODE_EXTENTS) != 0;
+}
+
+/* inline data: the bytes are in i_block, there is no block to map */
+static int is_inline(const struct inode *inode)
+{
+    return (inode->i_flags & INODE_INLINE) != 0;
+}
+
+static unsigned ext_count(const struct inode *inode)
+{
+    return (uint32_t)inode->i_block[0] & 0xFFFFu;
+}
+
+static unsigned ext_depth(const struct inode *inode)
+{
+    return (uint32_t)inode->i_block[0] >> 16;
+}
+
+/* extents one leaf block holds */
+static size_t leaf_cap(void)
+{
+    return (per_block() - 1) / 3;
+}
+
+/* last of n entries (stride ints apart) whose logical start is <= idx, -1 if none */
+static long ext_search(const int32_t *e, unsigned n, unsigned stride, size_t idx)
+{
+    unsigned lo = 0, hi = n;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if ((uint32_t)e[mid * stride] <= idx) lo = mid + 1;
+        else                                  hi = mid;
+    }
+    return (long)lo - 1;
+}
+
+static int ext_lookup(const int32_t *e, unsigned n, size_t idx)
+{
+    long k = ext_search(e, n, 3, idx);
+    if (k < 0) return -1;
+
+    const int32_t *x = e + k * 3;
+    if (idx - (uint32_t)x[0] >= (uint32_t)x[2]) return -1;
+    return x[1] + (int)(idx - (uint32_t)x[0]);
+}
+
+static int ext_get(const struct inode *inode, size_t idx)
+{
+    const int32_t *e = &inode->i_block[1];
+
+    if (idx > UINT32_MAX) return -1;
+    if (ext_depth(inode) == 0) return ext_lookup(e, ext_count(inode), idx);
+
+    long k = ext_search(e, ext_count(inode), 2, idx);
+    const int32_t *leaf = k < 0 ? NULL : map_block(0, e[k * 2 + 1]);
+    return leaf ? ext_lookup(leaf + 1, (unsigned)leaf[0], idx) : -1;
+}
+
+/* runs of consecutive blocks in blks */
+static size_t ext_runs(const int *blks, size_t n)
+{
+    size_t runs = n > 0 ? 1 : 0;
+
+    for (size_t i = 1; i < n; i++) {
+        if (blks[i] != blks[i - 1] + 1) runs++;
+    }
+    return runs;
+}
+
+/* write the runs of blks[0..n) as triples into out, at most max; the
+ * number of blocks covered */
+static size_t ext_fill(int32_t *out, size_t max, const int *blks, size_t first, size_t n, unsigned *cnt)
+{
+    size_t i = first;
+
+    *cnt = 0;
+    while (i < n && *cnt < max) {
+        size_t j = i + 1;
+        while (j < n && blks[j] == blks[j - 1] + 1 && j - i < UINT32_MAX) j++;
+
+        out[*cnt * 3]     = (int32_t)(uint32_t)i;
+        out[*cnt * 3 + 1] = blks[i];
+        out[*cnt * 3 + 2] = (int32_t)(uint32_t)(j - i);
+        (*cnt)++;
+        i = j;
+    }
+    return i - first;
+}
+
+/* extent map for blks: 0 done, 1 it doesn't fit (or leaves couldn't be
+ * had) and the map is left empty */
+static int ext_build(struct inode *inode, const int *blks, size_t n)
+{
+    size_t runs = ext_runs(blks, n);
+    unsigned cnt;
+
+    if (n > UINT32_MAX) return 1;
+    if (runs <= EXT_INLINE) {
+        ext_fill(&inode->i_block[1], EXT_INLINE, blks, 0, n, &cnt);
+        inode->i_block[0] = (int32_t)cnt;
+        inode->i_flags |= INODE_EXTENTS;
+        return 0;
+    }
+    if (runs > EXT_INDEX * leaf_cap()) return 1;
+
+    int32_t *ent = (int32_t *)malloc(block_size());
+    if (!ent) return 1;
+
+    unsigned leaves = 0;
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; leaves++) {
+        int got;
+        int leaf = block_alloc_extent(blks[i], 1, &got); /* after its data */
+        if (leaf < 0) {
+            rc = 1;
+            break;
+        }
+        inode->i_block[1 + leaves * 2] = (int32_t)(uint32_t)i;
+        inode->i_block[2 + leaves * 2] = leaf;
+
+        memset(ent, 0xFF, block_size());
+        i += ext_fill(ent + 1, leaf_cap(), blks, i, n, &cnt);
+        ent[0] = (int32_t)cnt;
+        map_forget(leaf);
+        if (block_write(leaf, ent) != 0) rc = 1;
+    }
+    free(ent);
+
+    if (rc != 0) {
+        /* give back the leaves made so far */
+        while (leaves-- > 0) {
+            map_forget(inode->i_block[2 + leaves * 2]);
+            block_free(inode->i_block[2 + leaves * 2]);
+        }
+        for (int k = 0; k < N_BLOCKS; k++) inode->i_block[k] = -1;
+        return 1;
+    }
+
+    inode->i_block[0] = (int32_t)(leaves | 1u << 16);
+    inode->i_flags |= INODE_EXTENTS;
+    return 0;
+}
+
+static int ext_walk_leaf(const int32_t *e, unsigned n, bmap_fn fn, void *arg)
+{
+    int rc = 0;
+
+    for (unsigned k = 0; k < n && rc == 0; k++) {
+        for (uint32_t b = 0; b < (uint32_t)e[k * 3 + 2] && rc == 0; b++)
+            rc = fn(e[k * 3 + 1] + (int)b, 0, arg);
+    }
+    return rc;
+}
+
+static int ext_walk(const struct inode *inode, bmap_fn fn, void *arg)
+{
+    const int32_t *e = &inode->i_block[1];
+
+    if (ext_depth(inode) == 0) return ext_walk_leaf(e, ext_count(inode), fn, arg);
+
+    int32_t *ent = (int32_t *)malloc(block_size());
+    if (!ent) return -1;
+
+    int rc = 0;
+    for (unsigned k = 0; k < ext_count(inode) && rc == 0; k++) {
+        int leaf = e[k * 2 + 1];
+        rc = block_read(leaf, ent);
+        if (rc == 0) rc = ext_walk_leaf(ent + 1, (unsigned)ent[0], fn, arg);
+        if (rc == 0) rc = fn(leaf, 1, arg);
+    }
+    free(ent);
+    return rc;
+}
+
+size_t bmap_max_blocks(void)
+{
+    uint64_t p = per_block(), span = p, n = DIRECT_BLOCKS;
+
+    for (int lvl = 0; lvl < MAP_LEVELS; lvl++, span *= p) n += span;
+    if (n > INT32_MAX) n = INT32_MAX; /* block numbers are int anyway */
+    return (size_t)n;
+}
+
+size_t bmap_map_blocks(size_t n)
+{
+    size_t p = per_block(), span = p, m = 0;
+
+    if (n <= DIRECT_BLOCKS) return 0;
+    n -= DIRECT_BLOCKS;
+    for (int lvl = 0; lvl < MAP_LEVELS && n > 0; lvl++, span *= p) {
+        size_t take = n < span ? n : span;
+
+        /* the top block, then each level below it down to the data */
+        m++;
+        for (size_t below = span / p; below > 1; below /= p) m += (take + below - 1) / below;
+        n -= take;
+    }
+    return m;
+}
+
+int bmap_get(const struct inode *inode, size_t idx)
+{
+    size_t p = per_block(), span = p;
+
+    if (is_inline(inode)) return -1;
+    if (is_ext(inode)) return ext_get(inode, idx);
+    if (idx < DIRECT_BLOCKS) return inode->i_block[idx];
+    idx -= DIRECT_BLOCKS;
+
+    for (int lvl = 0; lvl < MAP_LEVELS; lvl++) {
+        if (idx < span) {
+            int blk = inode->i_block[IND_BLOCK + lvl];
+            for (int d = lvl; d >= 0 && blk >= 0; d--) {
+                span /= p;
+                blk = map_entry(d, blk, idx / span);
+                idx %= span;
+            }
+            return blk;
+        }
+        idx -= span;
+        if (span > SIZE_MAX / p) return -1;
+        span *= p;
+    }
+    return -1;
+}
+
+typedef struct {
+    int   *out;
+    size_t n, got;
+} list_arg_t;
+
+static int list_one(int blkno, int is_map, void *arg)
+{
+    list_arg_t *l = (list_arg_t *)arg;
+
+    if (is_map) return 0;
+    if (l->got == l->n) return 1; /* enough */
+    l->out[l->got++] = blkno;
+    return 0;
+}
+
+size_t bmap_list(const struct inode *inode, int *out, size_t n)
+{
+    size_t i = 0;
+
+    if (is_inline(inode)) return 0;
+    if (is_ext(inode)) {
+        /* extents expand in order, no per-block search */
+        list_arg_t l = { out, n, 0 };
+        ext_walk(inode, list_one, &l);
+        return l.got;
+    }
+    for (; i < n; i++) {
+        out[i] = bmap_get(inode, i);
+        if (out[i] < 0) break;
+    }
+    return i;
+}
+
+/* one indirect block at depth over the next blocks of *blks, its children
+ * first. *out is set as soon as the block exists so a failure part way
+ * leaves a map bmap_clear can take apart */
+static int build_tree(int depth, const int **blks, size_t *left, int *out)
+{
+    size_t p = per_block();
+    int got;
+    int blk = block_alloc_extent(**blks, 1, &got); /* right after its data */
+    if (blk < 0) return -1;
+    *out = blk;
+
+    int32_t *ent = (int32_t *)malloc(block_size());
+    if (!ent) {
+        block_free(blk);
+        *out = -1;
+        return -1;
+    }
+    memset(ent, 0xFF, block_size());
+
+    int rc = 0;
+    for (size_t i = 0; i < p && *left > 0 && rc == 0; i++) {
+        if (depth == 0) {
+            ent[i] = *(*blks)++;
+            (*left)--;
+        } else {
+            int child = -1;
+            rc = build_tree(depth - 1, blks, left, &child);
+            ent[i] = child;
+        }
+    }
+    map_forget(blk);
+    if (block_write(blk, ent) != 0) rc = -1;
+    free(ent);
+    return rc;
+}
+
+/* the map for blks into an empty i_block; on failure it is empty again
+ * and blks are left alone */
+static int map_make(struct inode *inode, const int *blks, size_t n)
+{
+    size_t direct = n < DIRECT_BLOCKS ? n : DIRECT_BLOCKS;
+    const int *next = blks + direct;
+    size_t left = n - direct;
+    int rc = 0;
+
+    /* a few extents when the runs fit, a block per pointer when they don't */
+    inode->i_flags &= ~(INODE_EXTENTS | INODE_INLINE);
+    if (n > 0 && ext_build(inode, blks, n) == 0) return 0;
+
+    if (n > bmap_max_blocks()) rc = -1;
+    for (size_t i = 0; rc == 0 && i < direct; i++) inode->i_block[i] = blks[i];
+    for (int lvl = 0; rc == 0 && lvl < MAP_LEVELS && left > 0; lvl++)
+        rc = build_tree(lvl, &next, &left, &inode->i_block[IND_BLOCK + lvl]);
+    if (rc == 0 && left > 0) rc = -1;
+
+    if (rc != 0) bmap_clear(inode, 0);
+    return rc;
+}
+
+int bmap_build(struct inode *inode, const int *blks, size_t n)
+{
+    int rc = map_make(inode, blks, n);
+    if (rc != 0) {
+        for (size_t i = 0; i < n; i++) block_free(blks[i]);
+    }
+    return rc;
+}
+
+static int count_data(int blkno, int is_map, void *arg)
+{
+    (void)blkno;
+    if (!is_map) (*(size_t *)arg)++;
+    return 0;
+}
+
+/* the new map is made beside the old one and only takes its place
+ * whole, so a failure leaves the file as it was */
+int bmap_replace(struct inode *inode, const int *blks, size_t n)
+{
+    struct inode tmp;
+
+    memset(&tmp, 0, sizeof(tmp));
+    for (int i = 0; i < N_BLOCKS; i++) tmp.i_block[i] = -1;
+    if (map_make(&tmp, blks, n) != 0) return -1;
+
+    bmap_clear(inode, 0);
+    memcpy(inode->i_block, tmp.i_block, sizeof(inode->i_block));
+    inode->i_flags |= tmp.i_flags & INODE_EXTENTS;
+    return 0;
+}
+
+/* a runs straight on from b, in the file and on the device */
+static int ext_runs_on(const int32_t *a, const int32_t *b)
+{
+    return (uint32_t)a[0] + (uint32_t)a[2] == (uint32_t)b[0] && a[1] + a[2] == b[1] &&
+           (uint64_t)(uint32_t)a[2] + (uint32_t)b[2] <= UINT32_MAX;
+}
+
+/* triple k of t[0..n), which has file block idx, split round it with idx
+ * on blk, which joins a neighbour it runs on from; the new count, at
+ * most 2 more. t has room for them */
+static unsigned ext_split(int32_t *t, unsigned n, unsigned k, size_t idx, int blk)
+{
+    int32_t *x = t + k * 3;
+    uint32_t before = (uint32_t)idx - (uint32_t)x[0];
+    uint32_t after = (uint32_t)x[2] - before - 1;
+    int32_t piece[9];
+    unsigned m = 0;
+
+    if (before) {
+        piece[m * 3] = x[0];
+        piece[m * 3 + 1] = x[1];
+        piece[m * 3 + 2] = (int32_t)before;
+        m++;
+    }
+    piece[m * 3] = (int32_t)(uint32_t)idx;
+    piece[m * 3 + 1] = blk;
+    piece[m * 3 + 2] = 1;
+    m++;
+    if (after) {
+        piece[m * 3] = (int32_t)((uint32_t)idx + 1);
+        piece[m * 3 + 1] = x[1] + (int32_t)before + 1;
+        piece[m * 3 + 2] = (int32_t)after;
+        m++;
+    }
+    memmove(t + (k + m) * 3, t + (k + 1) * 3, (n - k - 1) * 3 * sizeof(int32_t));
+    memcpy(t + k * 3, piece, m * 3 * sizeof(int32_t));
+    n += m - 1;
+
+    unsigned j = k + (before ? 1 : 0);
+    if (j + 1 < n && ext_runs_on(t + j * 3, t + (j + 1) * 3)) {
+        t[j * 3 + 2] += t[(j + 1) * 3 + 2];
+        memmove(t + (j + 1) * 3, t + (j + 2) * 3, (n - j - 2) * 3 * sizeof(int32_t));
+        n--;
+    }
+    if (j > 0 && ext_runs_on(t + (j - 1) * 3, t + j * 3)) {
+        t[(j - 1) * 3 + 2] += t[j * 3 + 2];
+        memmove(t + j * 3, t + (j + 1) * 3, (n - j - 1) * 3 * sizeof(int32_t));
+        n--;
+    }
+    return n;
+}
+
+/* leaf blk holds the n triples t */
+static int ext_leaf_write(int blk, const int32_t *t, unsigned n)
+{
+    int32_t *ent = (int32_t *)malloc(block_size());
+    if (!ent) return -1;
+
+    memset(ent, 0xFF, block_size());
+    ent[0] = (int32_t)n;
+    memcpy(ent + 1, t, n * 3 * sizeof(int32_t));
+    map_forget(blk);
+    int rc = block_write(blk, ent);
+    free(ent);
+    return rc;
+}
+
+/* no room to split in place: list the file, swap the blocks and build
+ * the map again */
+static int remap_rebuild(struct inode *inode, size_t idx, const int *blks, size_t n)
+{
+    size_t have = 0;
+
+    ext_walk(inode, count_data, &have);
+    if (idx >= have || n > have - idx) return -1;
+
+    int *all = (int *)malloc(have * sizeof(int));
+    if (!all) return -1;
+    int rc = -1;
+    if (bmap_list(inode, all, have) == have) {
+        memcpy(all + idx, blks, n * sizeof(int));
+        rc = bmap_replace(inode, all, have);
+    }
+    free(all);
+    return rc;
+}
+
+/* file blocks [idx, idx + n) of an extent map onto blks in place, all in
+ * one leaf: each extent splits round what moves, a leaf that overflows
+ * splits in two. t is scratch for the triples. 0 done, 1 no room for
+ * that (the map is as it was), -1 error */
+static int ext_edit(struct inode *inode, int32_t *t, size_t idx, const int *blks, size_t n)
+{
+    int32_t *e = &inode->i_block[1];
+    unsigned cnt = ext_count(inode);
+    unsigned m = cnt, cap = EXT_INLINE;
+    long li = -1;
+    int leafblk = -1;
+
+    if (ext_depth(inode) == 0) {
+        memcpy(t, e, m * 3 * sizeof(int32_t));
+    } else {
+        li = ext_search(e, cnt, 2, idx);
+        const int32_t *leaf = li < 0 ? NULL : map_block(0, e[li * 2 + 1]);
+        if (!leaf) return -1;
+        if ((unsigned)li + 1 < cnt && idx + n > (uint32_t)e[(li + 1) * 2]) return 1; /* spans leaves */
+        leafblk = e[li * 2 + 1];
+        m = (unsigned)leaf[0];
+        cap = (unsigned)leaf_cap();
+        memcpy(t, leaf + 1, m * 3 * sizeof(int32_t));
+    }
+
+    int moved = 0;
+    for (size_t i = 0; i < n; i++) {
+        long k = ext_search(t, m, 3, idx + i);
+        if (k < 0 || idx + i - (uint32_t)t[k * 3] >= (uint32_t)t[k * 3 + 2]) return -1; /* not mapped */
+        if (t[k * 3 + 1] + (int)(idx + i - (uint32_t)t[k * 3]) == blks[i]) continue;
+        m = ext_split(t, m, (unsigned)k, idx + i, blks[i]);
+        moved = 1;
+    }
+    if (!moved) return 0;
+
+    if (m <= cap) {
+        if (leafblk >= 0) return ext_leaf_write(leafblk, t, m);
+        memcpy(e, t, m * 3 * sizeof(int32_t));
+        inode->i_block[0] = (int32_t)m;
+        return 0;
+    }
+    if (leafblk < 0 || cnt >= EXT_INDEX || m > 2 * cap) return 1;
+
+    /* the upper half to a new leaf right after this one */
+    unsigned h = m / 2;
+    int got;
+    int nl = block_alloc_extent(leafblk, 1, &got);
+    if (nl < 0) return 1;
+    if (ext_leaf_write(nl, t + h * 3, m - h) != 0 || ext_leaf_write(leafblk, t, h) != 0) {
+        map_forget(nl);
+        block_free(nl);
+        return -1;
+    }
+    memmove(e + (li + 2) * 2, e + (li + 1) * 2, (cnt - (unsigned)li - 1) * 2 * sizeof(int32_t));
+    e[(li + 1) * 2] = t[h * 3];
+    e[(li + 1) * 2 + 1] = nl;
+    inode->i_block[0] = (int32_t)((cnt + 1) | 1u << 16);
+    return 0;
+}
+
+static int ext_remap(struct inode *inode, size_t idx, const int *blks, size_t n)
+{
+    if (idx > UINT32_MAX || n > UINT32_MAX - idx) return -1;
+    if (n > leaf_cap()) return remap_rebuild(inode, idx, blks, n); /* most of a leaf anyway */
+
+    /* each block moved adds 2 triples at most */
+    int32_t *t = (int32_t *)malloc((per_block() + 6 * n + 6) * sizeof(int32_t));
+    if (!t) return -1;
+    int rc = ext_edit(inode, t, idx, blks, n);
+    free(t);
+    return rc > 0 ? remap_rebuild(inode, idx, blks, n) : rc;
+}
+
+int bmap_set(struct inode *inode, size_t idx, int blk)
+{
+    size_t p = per_block(), span = p;
+
+    if (is_inline(inode)) return -1;
+    if (is_ext(inode)) return ext_remap(inode, idx, &blk, 1);
+    if (idx < DIRECT_BLOCKS) {
+        if (inode->i_block[idx] < 0) return -1;
+        inode->i_block[idx] = blk;
+        return 0;
+    }
+    idx -= DIRECT_BLOCKS;
+
+    for (int lvl = 0; lvl < MAP_LEVELS; lvl++) {
+        if (idx < span) {
+            /* down to the indirect block holding the pointer */
+            int mb = inode->i_block[IND_BLOCK + lvl];
+            for (int d = lvl; d > 0 && mb >= 0; d--) {
+                span /= p;
+                mb = map_entry(d, mb, idx / span);
+                idx %= span;
+            }
+            const int32_t *ent = map_block(0, mb);
+            if (!ent || ent[idx] < 0) return -1;
+
+            int32_t *upd = (int32_t *)malloc(block_size());
+            if (!upd) return -1;
+            memcpy(upd, ent, block_size());
+            upd[idx] = blk;
+            map_forget(mb);
+            int rc = block_write(mb, upd);
+            free(upd);
+            return rc;
+        }
+        idx -= span;
+        if (span > SIZE_MAX / p) return -1;
+        span *= p;
+    }
+    return -1;
+}
+
+int bmap_remap(struct inode *inode, size_t idx, const int *blks, size_t n)
+{
+    if (is_inline(inode)) return -1;
+    if (n == 0) return 0;
+    if (is_ext(inode)) return ext_remap(inode, idx, blks, n);
+
+    /* pointers are set in place one by one; a failure puts back those done */
+    int *old = (int *)malloc(n * sizeof(int));
+    if (!old) return -1;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        old[i] = bmap_get(inode, idx + i);
+        if (old[i] < 0 || bmap_set(inode, idx + i, blks[i]) != 0) break;
+    }
+    int rc = i < n ? -1 : 0;
+    if (rc != 0)
+        while (i-- > 0) bmap_set(inode, idx + i, old[i]);
+    free(old);
+    return rc;
+}
+
+/* ---------- append ---------- */
+
+/* a new indirect block near blk, every pointer -1; -1 if none */
+static int map_new(int near)
+{
+    int got;
+    int mb = block_alloc_extent(near, 1, &got);
+    if (mb < 0) return -1;
+
+    int32_t *ent = (int32_t *)malloc(block_size());
+    if (!ent || (memset(ent, 0xFF, block_size()), block_write(mb, ent)) != 0) {
+        free(ent);
+        block_free(mb);
+        return -1;
+    }
+    free(ent);
+    map_forget(mb);
+    return mb;
+}
+
+/* entry i of map block mb (at depth) set to val, through its cache slot */
+static int map_store(int depth, int mb, size_t i, int val)
+{
+    if (!map_block(depth, mb)) return -1;
+    map_cache[depth].ent[i] = val;
+    if (block_write(mb, map_cache[depth].ent) == 0) return 0;
+    map_forget(mb);
+    return -1;
+}
+
+/* file block idx of a block map pointed at blk, indirect blocks made on
+ * the way down where there are none yet */
+static int map_put(struct inode *inode, size_t idx, int blk)
+{
+    size_t p = per_block(), span = p;
+
+    if (idx < DIRECT_BLOCKS) {
+        inode->i_block[idx] = blk;
+        return 0;
+    }
+    idx -= DIRECT_BLOCKS;
+
+    for (int lvl = 0; lvl < MAP_LEVELS; lvl++) {
+        if (idx < span) {
+            int *top = &inode->i_block[IND_BLOCK + lvl];
+            if (*top < 0 && (*top = map_new(blk)) < 0) return -1;
+
+            int mb = *top;
+            for (int d = lvl; d > 0; d--) {
+                span /= p;
+                size_t i = idx / span;
+                int child = map_entry(d, mb, i);
+                if (child < 0) {
+                    if ((child = map_new(blk)) < 0 || map_store(d, mb, i, child) != 0) return -1;
+                }
+                idx %= span;
+                mb = child;
+            }
+            return map_store(0, mb, idx, blk);
+        }
+        idx -= span;
+        if (span > SIZE_MAX / p) return -1;
+        span *= p;
+    }
+    return -1;
+}
+
+/* a run of len blocks from start at file block idx onto an extent map:
+ * the last extent grows when the run carries straight on from it, else
+ * it takes a free slot in place, in the last leaf or in a new leaf.
+ * 0 done, 1 no room left (the map is as it was), -1 error */
+static int ext_add(struct inode *inode, size_t idx, int start, size_t len)
+{
+    int32_t *e = &inode->i_block[1];
+    unsigned cnt = ext_count(inode);
+    int32_t *leaf = e;          /* depth 0: the triples are in place */
+    unsigned lcnt = cnt, cap = EXT_INLINE;
+    int leafblk = -1;
+
+    if (idx + len > UINT32_MAX) return 1;
+    if (ext_depth(inode) == 1) {
+        leafblk = e[(cnt - 1) * 2 + 1];
+        if (!map_block(0, leafblk)) return -1;
+        leaf = map_cache[0].ent + 1;
+        lcnt = (unsigned)map_cache[0].ent[0];
+        cap = (unsigned)leaf_cap();
+    }
+
+    int32_t *last = lcnt > 0 ? leaf + (lcnt - 1) * 3 : NULL;
+    if (last && (uint32_t)last[0] + (uint32_t)last[2] == idx &&
+        last[1] + last[2] == start && (uint64_t)(uint32_t)last[2] + len <= UINT32_MAX) {
+        last[2] = (int32_t)((uint32_t)last[2] + len);
+    } else if (lcnt < cap) {
+        leaf[lcnt * 3]     = (int32_t)(uint32_t)idx;
+        leaf[lcnt * 3 + 1] = start;
+        leaf[lcnt * 3 + 2] = (int32_t)(uint32_t)len;
+        lcnt++;
+    } else if (leafblk >= 0 && cnt < EXT_INDEX) {
+        /* the last leaf is full: one more leaf after the run */
+        int nl = map_new(start + (int)len);
+        if (nl < 0 || !map_block(0, nl)) return -1;
+        map_cache[0].ent[0] = 1;
+        map_cache[0].ent[1] = (int32_t)(uint32_t)idx;
+        map_cache[0].ent[2] = start;
+        map_cache[0].ent[3] = (int32_t)(uint32_t)len;
+        if (block_write(nl, map_cache[0].ent) != 0) return -1;
+        e[cnt * 2]     = (int32_t)(uint32_t)idx;
+        e[cnt * 2 + 1] = nl;
+        inode->i_block[0] = (int32_t)((cnt + 1) | 1u << 16);
+        return 0;
+    } else {
+        return 1;
+    }
+
+    if (leafblk < 0) {
+        inode->i_block[0] = (int32_t)lcnt;
+        return 0;
+    }
+    map_cache[0].ent[0] = (int32_t)lcnt;
+    if (block_write(leafblk, map_cache[0].ent) == 0) return 0;
+    map_forget(leafblk);
+    return -1;
+}
+
+/* blks as runs onto an extent map, all or nothing: a failure part way
+ * puts the last leaf and i_block back and frees the leaves made since.
+ * 0 done, 1 out of extents, -1 error */
+static int ext_append(struct inode *inode, size_t have, const int *blks, size_t n)
+{
+    int32_t saved[N_BLOCKS];
+    unsigned cnt = ext_count(inode);
+    int32_t *leaf = NULL;
+    int leafblk = -1;
+    int rc = 0;
+
+    memcpy(saved, inode->i_block, sizeof(saved));
+    if (ext_depth(inode) == 1) {
+        leafblk = saved[1 + (cnt - 1) * 2 + 1];
+        leaf = (int32_t *)malloc(block_size());
+        if (!leaf || block_read(leafblk, leaf) != 0) {
+            free(leaf);
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < n && rc == 0; ) {
+        size_t j = i + 1;
+        while (j < n && blks[j] == blks[j - 1] + 1) j++;
+        rc = ext_add(inode, have + i, blks[i], j - i);
+        i = j;
+    }
+
+    if (rc != 0 && leaf) {
+        for (unsigned k = cnt; k < ext_count(inode); k++) {
+            map_forget(inode->i_block[1 + k * 2 + 1]);
+            block_free(inode->i_block[1 + k * 2 + 1]);
+        }
+        map_forget(leafblk);
+        if (block_write(leafblk, leaf) != 0) rc = -1;
+    }
+    if (rc != 0) memcpy(inode->i_block, saved, sizeof(saved));
+    free(leaf);
+    return rc;
+}
+
+/* the map with its have blocks and blks after them, all of it afresh */
+static int append_rebuild(struct inode *inode, size_t have, const int *blks, size_t n)
+{
+    int *all = (int *)malloc((have + n) * sizeof(int));
+    if (!all) return -1;
+
+    int rc = -1;
+    if (bmap_list(inode, all, have) == have) {
+        memcpy(all + have, blks, n * sizeof(int));
+        rc = bmap_replace(inode, all, have + n);
+    }
+    free(all);
+    return rc;
+}
+
+int bmap_append(struct inode *inode, size_t have, const int *blks, size_t n)
+{
+    int rc = 0;
+
+    if (is_inline(inode) || have + n > bmap_max_blocks()) return -1;
+    if (n == 0) return 0;
+    if (have == 0) {
+        /* nothing mapped yet: pick the layout as a build would */
+        for (int i = 0; i < N_BLOCKS; i++) inode->i_block[i] = -1;
+        inode->i_flags &= ~INODE_EXTENTS;
+        if (ext_build(inode, blks, n) == 0) return 0;
+    }
+
+    if (is_ext(inode)) {
+        rc = ext_append(inode, have, blks, n);
+        return rc > 0 ? append_rebuild(inode, have, blks, n) : rc; /* out of extents */
+    }
+
+    if (block_free_blocks() < bmap_map_blocks(have + n) - bmap_map_blocks(have)) return -1;
+    size_t i = 0;
+    for (; i < n && rc == 0; i++) rc = map_put(inode, have + i, blks[i]);
+    if (rc != 0) {
+        /* take back the pointers already in; their path is there */
+        while (i-- > 0) map_put(inode, have + i, -1);
+    }
+    return rc;
+}
+
+static int walk_tree(int depth, int blk, bmap_fn fn, void *arg)
+{
+    size_t p = per_block();
+    int32_t *ent = (int32_t *)malloc(block_size());
+    if (!ent) return -1;
+
+    int rc = block_read(blk, ent);
+    for (size_t i = 0; i < p && rc == 0; i++) {
+        if (ent[i] < 0) continue;
+        rc = depth == 0 ? fn(ent[i], 0, arg) : walk_tree(depth - 1, ent[i], fn, arg);
+    }
+    free(ent);
+    return rc != 0 ? rc : fn(blk, 1, arg);
+}
+
+int bmap_walk(const struct inode *inode, bmap_fn fn, void *arg)
+{
+    int rc = 0;
+
+    if (is_inline(inode)) return 0;
+    if (is_ext(inode)) return ext_walk(inode, fn, arg);
+
+    for (int i = 0; i < DIRECT_BLOCKS && rc == 0; i++) {
+        if (inode->i_block[i] >= 0) rc = fn(inode->i_block[i], 0, arg);
+    }
+    for (int lvl = 0; lvl < MAP_LEVELS && rc == 0; lvl++) {
+        if (inode->i_block[IND_BLOCK + lvl] >= 0)
+            rc = walk_tree(lvl, inode->i_block[IND_BLOCK + lvl], fn, arg);
+    }
+    return rc;
+}
+
+static int free_one(int blkno, int is_map, void *arg)
+{
+    if (is_map) map_forget(blkno);
+    if (is_map || *(const int *)arg) block_free(blkno);
+    return 0;
+}
+
+void bmap_clear(struct inode *inode, int free_data)
+{
+    bmap_walk(inode, free_one, &free_data);
+    for (int i = 0; i < N_BLOCKS; i++) inode->i_block[i] = -1;
+    inode->i_flags &= ~(INODE_EXTENTS | INODE_INLINE);
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lz.h"
+
+/* a sequence is a token (literal count << 4 | match length - 4, 15 means
+ * more length bytes follow, 255 at a time), the literals, then a 2-byte
+ * little-endian match offset and the extra match length. the last
+ * sequence is literals only and ends the input. */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_WINDOW    65535
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static size_t lz_hash(uint32_t v)
+{
+    return (size_t)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* mlen 0: the closing literals-only sequence */
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+                        size_t nlit, size_t off, size_t mlen)
+{
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+    if (op >= oend) return NULL;
+    uint8_t *tok = op++;
+    *tok = (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(off & 0xFF);
+    *op++ = (uint8_t)(off >> 8);
+    if (ml >= 15 && !(op = put_len(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    const uint8_t *ip = in, *anchor = in, *end = in + len;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *oend = op + cap;
+    uint32_t table[1u << LZ_HASH_BITS];
+    size_t misses = 0;
+
+    memset(table, 0, sizeof(table));
+    while (len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t v = read32(ip);
+        size_t h = lz_hash(v);
+        const uint8_t *ref = in + table[h];
+        table[h] = (uint32_t)(ip - in);
+
+        if (ref < ip && (size_t)(ip - ref) <= LZ_WINDOW && read32(ref) == v) {
+            const uint8_t *mp = ip + LZ_MIN_MATCH, *rp = ref + LZ_MIN_MATCH;
+            while (mp < end && *mp == *rp) { mp++; rp++; }
+
+            op = put_seq(op, oend, anchor, (size_t)(ip - anchor),
+                         (size_t)(ip - ref), (size_t)(mp - ip));
+            if (!op) return 0;
+            ip = anchor = mp;
+            misses = 0;
+            continue;
+        }
+        /* incompressible stretches are skipped over faster and faster */
+        ip += 1 + (misses++ >> 5);
+    }
+
+    op = put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t out_len)
+{
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+    uint8_t *op = (uint8_t *)dst, *ostart = op, *oend = op + out_len;
+
+    while (ip < iend) {
+        unsigned tok = *ip++;
+
+        size_t nlit = tok >> 4;
+        if (nlit == 15 && get_len(&ip, iend, &nlit) != 0) return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = tok & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) != 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - ostart) || mlen > (size_t)(oend - op)) return -1;
+
+        const uint8_t *m = op - off;
+        if (off >= mlen) {
+            memcpy(op, m, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *m++; /* overlapping: a repeat */
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* compress then decompress data chunk by chunk, as the block layer does
+ * (a chunk that does not shrink by an eighth is stored raw),
+ * on one thread for about half a second each way */
+void lz_bench(const uint8_t *data, size_t len, size_t chunk)
+{
+    size_t nchunks, stored = 0, rounds, bad = 0;
+    double t0, tc, td;
+
+    if (!data || len == 0 || chunk == 0) {
+        printf("lzbench: nothing to do\n");
+        return;
+    }
+    nchunks = (len + chunk - 1) / chunk;
+
+    uint8_t *packed = malloc(nchunks * chunk);
+    size_t *clen = calloc(nchunks, sizeof(size_t));
+    uint8_t *out = malloc(chunk);
+    if (!packed || !clen || !out) {
+        printf("lzbench: out of memory\n");
+        free(packed); free(clen); free(out);
+        return;
+    }
+
+    rounds = 0;
+    t0 = now_sec();
+    do {
+        stored = 0;
+        for (size_t i = 0; i < nchunks; i++) {
+            size_t n = i + 1 < nchunks ? chunk : len - i * chunk;
+            clen[i] = lz_compress(data + i * chunk, n, packed + i * chunk, n - n / 8);
+            stored += clen[i] ? clen[i] : n;
+        }
+        rounds++;
+    } while ((tc = now_sec() - t0) < 0.5);
+    double c_mbs = (double)len * (double)rounds / tc / 1e6;
+
+    size_t packed_n = 0;
+    for (size_t i = 0; i < nchunks; i++) packed_n += clen[i] != 0;
+
+    rounds = 0;
+    t0 = now_sec();
+    do {
+        if (!packed_n) break; /* nothing to time */
+        for (size_t i = 0; i < nchunks; i++) {
+            size_t n = i + 1 < nchunks ? chunk : len - i * chunk;
+            if (!clen[i]) continue; /* stored raw */
+            if (lz_decompress(packed + i * chunk, clen[i], out, n) != 0 ||
+                memcmp(out, data + i * chunk, n) != 0)
+                bad++;
+        }
+        rounds++;
+    } while ((td = now_sec() - t0) < 0.5);
+    double d_mbs = (double)len * (double)rounds / td / 1e6;
+
+    printf("lzbench: %zu bytes in %zu-byte blocks, ratio %.2f (%zu stored)\n",
+           len, chunk, (double)len / (double)stored, stored);
+    printf("  compress   %8.1f MB/s per core\n", c_mbs);
+    if (packed_n)
+        printf("  decompress %8.1f MB/s per core%s\n", d_mbs, bad ? "  (ROUND TRIP FAILED)" : "");
+    else
+        printf("  decompress        - (no block got smaller)\n");
+
+    free(packed);
+    free(clen);
+    free(out);
+}
@@ -0,0 +1,13 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* small LZ77 codec for data blocks (LZ4-style sequences, 64 KB window) */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap); /* bytes out, 0 if over cap */
+int    lz_decompress(const void *src, size_t len, void *dst, size_t out_len); /* 0 ok, -1 corrupt */
+
+void   lz_bench(const uint8_t *data, size_t len, size_t chunk); /* per-core throughput, to stdout */
+
+#endif /* _LZ_H_ */
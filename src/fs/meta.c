@@ -8,13 +8,17 @@
 #include "vfs_internal.h"
 #include "dentry.h"
 #include "inode.h"
+#include "bmap.h"
 
 /* ---------- on-disk layout ---------- */
 #define META_MAGIC 0x4D455441u /* 'META' */
-#define META_VER   1
+#define META_VER   5  /* v1: entries packed from block 1, v2: chained entry blocks,
+                       * v3: entries carry the indirect block pointers,
+                       * v4: inode flags (extents) and 64-bit sizes,
+                       * v5: inline data in blocks[] */
 
 #define META_BLK_HEADER 0
-#define META_BLK_ENTRIES_START 1
+#define META_BLK_ENTRIES_START 1  /* v1 only */
 #define META_MAX_ENTRIES 1024
 
 /* root entries only (for Phase 4-2) */
@@ -23,7 +27,7 @@ typedef struct
     uint32_t magic;
     uint32_t ver;
     uint32_t entry_count;
-    uint32_t reserved;
+    int32_t  first_blk;     /* v2: first entry block, -1 none (v1: unused) */
 } meta_header_t;
 
 #define NAME_MAX_ONDISK 60
@@ -32,26 +36,156 @@ typedef struct
 {
     uint8_t  used;          /* 0 free, 1 used */
     uint8_t  type;          /* FS_INODE_FILE / FS_INODE_DIR */
-    uint16_t reserved0;
-    uint32_t size;          /* file size */
-    int32_t  blocks[DIRECT_BLOCKS]; /* direct blocks */
+    uint16_t mode;          /* i_mode, 0 on older images: default */
+    uint32_t flags;         /* i_flags */
+    uint64_t size;          /* file size */
+    int32_t  blocks[N_BLOCKS]; /* block map, extents or inline bytes, as in i_block */
     int32_t  parent;
     char     name[NAME_MAX_ONDISK]; /* null-terminated if fits */
 } meta_entry_t;
 
+/* v3 entry: 32-bit size, always a block map */
+typedef struct 
+{
+    uint8_t  used;
+    uint8_t  type;
+    uint16_t mode;
+    uint32_t size;
+    int32_t  blocks[N_BLOCKS];
+    int32_t  parent;
+    char     name[NAME_MAX_ONDISK];
+} meta_entry_v3_t;
+
+/* v1 / v2 entry: direct blocks only */
+typedef struct 
+{
+    uint8_t  used;
+    uint8_t  type;
+    uint16_t mode;
+    uint32_t size;
+    int32_t  blocks[DIRECT_BLOCKS];
+    int32_t  parent;
+    char     name[NAME_MAX_ONDISK];
+} meta_entry_v2_t;
+
 static void entry_clear(meta_entry_t *e) 
 {
     memset(e, 0, sizeof(*e));
-    for (int i = 0; i < DIRECT_BLOCKS; i++) e->blocks[i] = -1;
+    for (int i = 0; i < N_BLOCKS; i++) e->blocks[i] = -1;
 }
 
 static void inode_init_blocks(struct inode *ino) 
 {
-    for (int i = 0; i < DIRECT_BLOCKS; i++) ino->i_block[i] = -1;
+    for (int i = 0; i < N_BLOCKS; i++) ino->i_block[i] = -1;
+}
+
+static size_t entry_size(uint32_t ver)
+{
+    if (ver >= 4) return sizeof(meta_entry_t);
+    return ver == 3 ? sizeof(meta_entry_v3_t) : sizeof(meta_entry_v2_t);
+}
+
+/* an entry as stored by ver, in the current layout */
+static void entry_decode(meta_entry_t *e, const uint8_t *p, uint32_t ver)
+{
+    if (ver >= 4) {
+        memcpy(e, p, sizeof(*e));
+        return;
+    }
+    if (ver == 3) {
+        meta_entry_v3_t v3;
+        memcpy(&v3, p, sizeof(v3));
+        entry_clear(e);
+        e->used   = v3.used;
+        e->type   = v3.type;
+        e->mode   = v3.mode;
+        e->size   = v3.size;
+        e->parent = v3.parent;
+        memcpy(e->blocks, v3.blocks, sizeof(v3.blocks));
+        memcpy(e->name, v3.name, sizeof(e->name));
+        return;
+    }
+
+    meta_entry_v2_t old;
+    memcpy(&old, p, sizeof(old));
+    entry_clear(e);
+    e->used   = old.used;
+    e->type   = old.type;
+    e->mode   = old.mode;
+    e->size   = old.size;
+    e->parent = old.parent;
+    memcpy(e->blocks, old.blocks, sizeof(old.blocks));
+    memcpy(e->name, old.name, sizeof(e->name));
 }
 
 static meta_entry_t g_entries[META_MAX_ENTRIES];
 static uint32_t g_entry_count;
+static int g_dirty;  /* in-memory tree is ahead of the saved one */
+
+void meta_mark_dirty(void)
+{
+    g_dirty = 1;
+}
+
+int meta_dirty(void)
+{
+    return g_dirty;
+}
+
+/* entries per entry block; v2 keeps the next-block link in the last 4 bytes */
+static uint32_t entries_per_block(uint32_t ver)
+{
+    size_t room = block_size();
+    if (ver >= 2) room -= sizeof(int32_t);
+    return (uint32_t)(room / entry_size(ver));
+}
+
+static int32_t entry_block_next(const uint8_t *buf)
+{
+    int32_t next;
+    memcpy(&next, buf + block_size() - sizeof(next), sizeof(next));
+    return next;
+}
+
+/* walk the entry blocks named by hdr: v1 is a run from block 1, v2 a chain */
+typedef int (*entry_block_fn)(int blkno, const uint8_t *buf, void *arg);
+
+static int for_each_entry_block(const meta_header_t *hdr, entry_block_fn fn, void *arg)
+{
+    uint8_t  buf[BLOCK_SIZE_MAX];
+    uint32_t per = entries_per_block(hdr->ver);
+    if (per == 0) return -1;
+
+    uint32_t nblocks = (hdr->entry_count + per - 1) / per;
+    int32_t  blkno = (hdr->ver >= 2) ? hdr->first_blk : META_BLK_ENTRIES_START;
+
+    for (uint32_t b = 0; b < nblocks; b++)
+    {
+        if (blkno < 0 || block_read(blkno, buf) != 0) return -1;
+        if (fn(blkno, buf, arg) != 0) return -1;
+        blkno = (hdr->ver >= 2) ? entry_block_next(buf) : blkno + 1;
+    }
+    return 0;
+}
+
+static int free_entry_block(int blkno, const uint8_t *buf, void *arg)
+{
+    (void)buf; (void)arg;
+    block_free(blkno);
+    return 0;
+}
+
+/* current on-disk header, 0 if there is one */
+static int read_header(meta_header_t *hdr)
+{
+    uint8_t buf[BLOCK_SIZE_MAX];
+
+    if (block_read(META_BLK_HEADER, buf) != 0) return -1;
+    memcpy(hdr, buf, sizeof(*hdr));
+
+    if (hdr->magic != META_MAGIC || hdr->ver == 0 || hdr->ver > META_VER) return -1;
+    return 0;
+}
 
 
 /* count root children */
@@ -79,10 +213,12 @@ static void save_dentry_recursive(struct dentry *d, int parent_idx)
 
     e->used   = 1;
     e->type   = (uint8_t)d->d_inode->i_type;
-    e->size   = (uint32_t)d->d_inode->i_size;
+    e->mode   = (uint16_t)d->d_inode->i_mode;
+    e->flags  = d->d_inode->i_flags;
+    e->size   = (uint64_t)d->d_inode->i_size;
     e->parent = parent_idx;
 
-    for (int i = 0; i < DIRECT_BLOCKS; i++) {
+    for (int i = 0; i < N_BLOCKS; i++) {
         e->blocks[i] = d->d_inode->i_block[i];
     }
 
@@ -97,8 +233,9 @@ static void save_dentry_recursive(struct dentry *d, int parent_idx)
 
 int meta_save(void)
 {
-    uint8_t buf[BLOCK_SIZE];
+    uint8_t buf[BLOCK_SIZE_MAX];
     meta_header_t hdr;
+    size_t bs = block_size();
 
     struct super_block *sb = fs_get_super();
     if (!sb || !sb->s_root) return -1;
@@ -109,102 +246,117 @@ int meta_save(void)
         save_dentry_recursive(c, -1);
     }
 
-    /* 2) reserve meta blocks */
+    /* 2) drop the old entry blocks; new ones come from the allocator so
+     *    they can never land on file data */
+    if (read_header(&hdr) == 0) {
+        for_each_entry_block(&hdr, free_entry_block, NULL);
+    }
     block_reserve(META_BLK_HEADER);
 
-    uint32_t entry_bytes  = g_entry_count * sizeof(meta_entry_t);
-    uint32_t entry_blocks = (entry_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    /* 3) write entries as a chain */
+    uint32_t per = entries_per_block(META_VER);
+    int32_t first = -1;
+    int32_t blkno = -1;
+
+    if (g_entry_count > 0) 
+    {
+        first = blkno = block_alloc();
+        if (blkno < 0) return -1;
+    }
+
+    for (uint32_t i = 0; i < g_entry_count; ) 
+    {
+        uint32_t n = g_entry_count - i;
+        if (n > per) n = per;
+
+        memset(buf, 0, bs);
+        memcpy(buf, &g_entries[i], n * sizeof(meta_entry_t));
+        i += n;
+
+        int32_t next = -1;
+        if (i < g_entry_count) 
+        {
+            next = block_alloc();
+            if (next < 0) return -1;
+        }
+        memcpy(buf + bs - sizeof(next), &next, sizeof(next));
 
-    for (uint32_t b = 0; b < entry_blocks; b++) {
-        block_reserve(META_BLK_ENTRIES_START + b);
+        if (block_write(blkno, buf) != 0) return -1;
+        blkno = next;
     }
 
-    /* 3) write header */
+    /* 4) write header */
     memset(&hdr, 0, sizeof(hdr));
     hdr.magic = META_MAGIC;
     hdr.ver   = META_VER;
     hdr.entry_count = g_entry_count;
+    hdr.first_blk = first;
 
-    memset(buf, 0, sizeof(buf));
+    memset(buf, 0, bs);
     memcpy(buf, &hdr, sizeof(hdr));
     if (block_write(META_BLK_HEADER, buf) != 0) return -1;
 
-    /* 4) write entries */
-    uint32_t blkno = META_BLK_ENTRIES_START;
-    uint32_t offset = 0;
-    memset(buf, 0, sizeof(buf));
+    g_dirty = 0;
+    return 0;
+}
 
-    for (uint32_t i = 0; i < g_entry_count; i++) 
-    {
-        if (offset + sizeof(meta_entry_t) > BLOCK_SIZE) 
-        {
-            if (block_write(blkno, buf) != 0) return -1;
-            blkno++;
-            offset = 0;
-            memset(buf, 0, sizeof(buf));
-        }
+typedef struct {
+    meta_entry_t *list;
+    uint32_t      count;
+    uint32_t      per;
+    uint32_t      ver;
+    uint32_t      loaded;
+} entry_reader_t;
 
-        memcpy(buf + offset, &g_entries[i], sizeof(meta_entry_t));
-        offset += sizeof(meta_entry_t);
-    }
+static int read_entry_block(int blkno, const uint8_t *buf, void *arg)
+{
+    entry_reader_t *r = (entry_reader_t *)arg;
 
-    if (g_entry_count > 0) 
+    if (block_reserve(blkno) != 0) return -1;
+
+    for (uint32_t k = 0; k < r->per && r->loaded < r->count; k++) 
     {
-        if (block_write(blkno, buf) != 0) return -1;
+        entry_decode(&r->list[r->loaded++], buf + k * entry_size(r->ver), r->ver);
     }
-
     return 0;
 }
 
-
+/* mount: a block some file holds; with dedup on, its data can be shared
+ * from as well */
+static int claim_block(int blkno, int is_map, void *arg)
+{
+    (void)arg;
+    block_claim(blkno);
+    if (!is_map && block_dedup_enabled()) block_dedup_index(blkno);
+    return 0;
+}
 
 int meta_load(void)
 {
     struct dentry *dent_list[META_MAX_ENTRIES] = {0};
     meta_entry_t   entry_list[META_MAX_ENTRIES];
 
-    uint8_t buf[BLOCK_SIZE];
     meta_header_t hdr;
 
     struct super_block *sb = fs_get_super();
     if (!sb || !sb->s_root) return -1;
 
-    if (block_read(META_BLK_HEADER, buf) != 0) return -1;
-    memcpy(&hdr, buf, sizeof(hdr));
+    /* the header block belongs to meta even on an empty fs */
+    block_reserve(META_BLK_HEADER);
+    bmap_reset();
 
-    if (hdr.magic != META_MAGIC || hdr.ver != META_VER) 
+    if (read_header(&hdr) != 0) 
     {
         return 0; // empty fs
     }
 
-    // reserve meta blocks
-    block_reserve(META_BLK_HEADER);
-    uint32_t entry_bytes  = hdr.entry_count * (uint32_t)sizeof(meta_entry_t);
-    uint32_t entry_blocks = (entry_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    for (uint32_t b = 0; b < entry_blocks; b++) 
-    {
-        block_reserve((int)(META_BLK_ENTRIES_START + b));
-    }
-
     uint32_t to_load = hdr.entry_count;
+    if (to_load > META_MAX_ENTRIES) return -1;
     if (to_load == 0) return 0;
 
-    // 讀 entries：先填 entry_list[]
-    uint32_t blkno = META_BLK_ENTRIES_START;
-    uint32_t offset = 0;
-    if (block_read((int)blkno, buf) != 0) return -1;
-
-    for (uint32_t i = 0; i < to_load; i++) 
-    {
-        if (offset + sizeof(meta_entry_t) > BLOCK_SIZE) 
-        {
-            blkno++;
-            offset = 0;
-            if (block_read((int)blkno, buf) != 0) return -1;
-        }
-        memcpy(&entry_list[i], buf + offset, sizeof(meta_entry_t));
-        offset += (uint32_t)sizeof(meta_entry_t);
-    }
+    // 讀 entries：先填 entry_list[]，順便把 meta blocks 標成 used
+    entry_reader_t rd = { entry_list, to_load, entries_per_block(hdr.ver), hdr.ver, 0 };
+    if (for_each_entry_block(&hdr, read_entry_block, &rd) != 0) return -1;
 
     // 第 1 pass：create dent/inode，但先不掛 tree
     for (uint32_t i = 0; i < to_load; i++) 
@@ -219,12 +371,15 @@ int meta_load(void)
         ino->i_size  = (size_t)e->size;
         ino->i_mtime = (uint64_t)time(NULL);
         ino->i_mode  = (ino->i_type == FS_INODE_DIR) ? (FS_IFDIR | 0755) : (FS_IFREG | 0644);
+        if (e->mode) ino->i_mode = e->mode;
 
         inode_init_blocks(ino);
-        for (int k = 0; k < DIRECT_BLOCKS; k++) 
+        if (ino->i_type == FS_INODE_FILE)
         {
-            ino->i_block[k] = e->blocks[k];
-            if (e->blocks[k] >= 0) block_reserve(e->blocks[k]); // 保險：把檔案 data block 標成 used
+            ino->i_flags = e->flags;
+            for (int k = 0; k < N_BLOCKS; k++) ino->i_block[k] = e->blocks[k];
+            // 標成 used；reflink 共用的 block 會被數到多次，indirect block 也算
+            if (bmap_walk(ino, claim_block, NULL) != 0) { free(ino); return -1; }
         }
 
         struct dentry *dent = (struct dentry*)calloc(1, sizeof(struct dentry));
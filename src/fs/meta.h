@@ -5,4 +5,7 @@
 int meta_load(void);
 int meta_save(void);
 
+void meta_mark_dirty(void); /* tree or an inode changed since the last save */
+int  meta_dirty(void);
+
 #endif /* _META_H_ */
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include "dentry.h"
 #include "block.h"
 #include "perm.h"
+#include "meta.h"
+#include "bmap.h"
 /* user define library done */
 
 /* user define function*/
@@ -253,6 +255,10 @@ static int vfs_mkdir_path_internal(const char *path)
   inode->i_nlink = 1;
   inode->i_size  = 0;
   inode->i_mtime = (uint64_t)time(NULL);
+  for (int i = 0; i < N_BLOCKS; i++)
+  {
+    inode->i_block[i] = -1;
+  }
 
   dentry = calloc(1, sizeof(struct dentry));
   if (!dentry)
@@ -277,6 +283,7 @@ static int vfs_mkdir_path_internal(const char *path)
     free(inode);
     return -1;
   }
+  meta_mark_dirty();
 
   return 0;
 }
@@ -338,12 +345,9 @@ int vfs_rm(const char *path)
   {
     return -1;
   }
-  for (int i = 0; i < DIRECT_BLOCKS; i++) {
-    if (inode->i_block[i] >= 0) {
-      block_free(inode->i_block[i]);
-      inode->i_block[i] = -1;
-    }
-  }
+  vfs_fd_forget(inode);
+  bmap_clear(inode, 1);
+  meta_mark_dirty();
 
   free(inode);
 
@@ -406,6 +410,7 @@ int vfs_rmdir(const char *path)
   {
     return -1;
   }
+  meta_mark_dirty();
   free(inode);
 
   if (dent->d_name)
@@ -470,5 +475,6 @@ int vfs_chmod(const char *path, int mode)
       (dent->d_inode->i_mode & FS_IFDIR) | (mode & 0777);
 
   dent->d_inode->i_mtime = (uint64_t)time(NULL);
+  meta_mark_dirty();
   return 0;
 }
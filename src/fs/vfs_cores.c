@@ -10,12 +10,16 @@
 #include "dentry.h"
 #include "path.h"
 #include "block.h"
+#include "meta.h"
+
+#define VFS_COMMIT_MS 1000 /* group commit: a batch waits at most this long */
 
 /* global super block and cwd */
 static struct super_block g_sb;
 static struct dentry *g_cwd;
 static fs_uid_t g_uid = 1000;
 static fs_gid_t g_gid = 1000;
+static uint64_t g_batch_start; /* ms, when the open batch was first seen */
 /* --- getters / setters --- */
 
 fs_uid_t fs_get_uid(void)
@@ -158,7 +162,7 @@ int fs_init(void)
   root_inode->i_size  = 0;
   root_inode->i_mtime = (uint64_t)time(NULL);
 
-  for (int i = 0; i < DIRECT_BLOCKS; i++)
+  for (int i = 0; i < N_BLOCKS; i++)
   {
     root_inode->i_block[i] = -1; 
   }
@@ -181,6 +185,65 @@ int fs_init(void)
   return 0;
 }
 
+/* --- vfs_sync: checkpoint mid-session --- */
+
+int vfs_sync(void)
+{
+  if (meta_save() != 0)
+  {
+    return -1;
+  }
+  return block_sync();
+}
+
+/* --- group commit: everything since the last commit shares one journal write --- */
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int vfs_commit_due_in(void)
+{
+  size_t cap = block_log_capacity();
+
+  if (cap == 0)
+  {
+    return -1;  /* no journal: only sync / exit save */
+  }
+  if (!meta_dirty() && block_pending() == 0)
+  {
+    g_batch_start = 0;
+    return -1;
+  }
+
+  uint64_t now = now_ms();
+  if (g_batch_start == 0)
+  {
+    g_batch_start = now;
+  }
+  if (block_pending() >= cap / 4)
+  {
+    return 0;  /* big batch: log it before it outgrows the journal */
+  }
+  uint64_t age = now - g_batch_start;
+  return age >= VFS_COMMIT_MS ? 0 : (int)(VFS_COMMIT_MS - age);
+}
+
+int vfs_commit(void)
+{
+  g_batch_start = 0;
+
+  /* namespace + inode changes go in as the metadata blocks they rewrite */
+  if (meta_dirty() && meta_save() != 0)
+  {
+    return -1;
+  }
+  return block_commit();
+}
+
 /* --- vfs_get_cwd: 提供給 shell 顯示 prompt --- */
 
 int vfs_get_cwd(char *buf, size_t size)
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vfs.h"
+#include "vfs_internal.h"
+#include "inode.h"
+#include "dentry.h"
+#include "perm.h"
+
+/* ---------- open file table ----------
+ * an fd is a slot here: the file, where the next read / write goes and
+ * what it was opened for. permissions are checked once, at open, the way
+ * a kernel does; reads and writes only look at the flags. */
+#define VFS_MAX_FDS 64
+
+#define FD_RD     0x1
+#define FD_WR     0x2
+#define FD_APPEND 0x4  /* every write goes to the end (O_APPEND) */
+
+typedef struct
+{
+  int            open;   /* 0: slot free */
+  struct inode  *inode;  /* NULL: the file was removed, the fd only closes */
+  struct dentry *dent;
+  int            flags;  /* FD_RD / FD_WR / FD_APPEND */
+  fs_off_t       pos;
+} vfs_file_t;
+
+static vfs_file_t fd_table[VFS_MAX_FDS];
+
+static vfs_file_t *fd_slot(int fd)
+{
+  if (fd < 0 || fd >= VFS_MAX_FDS || !fd_table[fd].open)
+  {
+    return NULL;
+  }
+  return &fd_table[fd];
+}
+
+/* an open fd whose file is still there */
+static vfs_file_t *fd_get(int fd)
+{
+  vfs_file_t *f = fd_slot(fd);
+  return f && f->inode ? f : NULL;
+}
+
+/* fopen-style mode: r, r+, w, w+, a, a+ ("b" ignored); -1 if it isn't one */
+static int parse_mode(const char *mode, int *flags, int *trunc, int *create)
+{
+  if (!mode)
+  {
+    return -1;
+  }
+  switch (mode[0])
+  {
+    case 'r': *flags = FD_RD;             *trunc = 0; *create = 0; break;
+    case 'w': *flags = FD_WR;             *trunc = 1; *create = 1; break;
+    case 'a': *flags = FD_WR | FD_APPEND; *trunc = 0; *create = 1; break;
+    default:  return -1;
+  }
+  for (const char *c = mode + 1; *c; c++)
+  {
+    if (*c == '+')
+    {
+      *flags |= FD_RD | FD_WR;
+    }
+    else if (*c != 'b')
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int vfs_open(const char *path, const char *mode)
+{
+  int flags, trunc, create;
+
+  if (!path || path[0] == '\0' || parse_mode(mode, &flags, &trunc, &create) != 0)
+  {
+    return -1;
+  }
+
+  struct dentry *dent = vfs_lookup(path);
+  if (!dent && create)
+  {
+    if (vfs_create_file(path) != 0)
+    {
+      return -1;
+    }
+    dent = vfs_lookup(path);
+  }
+  if (!dent || !dent->d_inode || dent->d_inode->i_type != FS_INODE_FILE)
+  {
+    return -1;
+  }
+
+  struct inode *inode = dent->d_inode;
+  if (((flags & FD_RD) && fs_perm_check(inode, FS_R_OK) != 0) ||
+      ((flags & FD_WR) && fs_perm_check(inode, FS_W_OK) != 0))
+  {
+    return -1;
+  }
+
+  int fd = 0;
+  while (fd < VFS_MAX_FDS && fd_table[fd].open)
+  {
+    fd++;
+  }
+  if (fd == VFS_MAX_FDS)
+  {
+    return -1;
+  }
+
+  if (trunc && inode->i_size > 0 && inode_write_bytes(inode, dent->d_parent, NULL, 0) != 0)
+  {
+    return -1;
+  }
+
+  fd_table[fd].open  = 1;
+  fd_table[fd].inode = inode;
+  fd_table[fd].dent  = dent;
+  fd_table[fd].flags = flags;
+  fd_table[fd].pos   = 0;
+  return fd;
+}
+
+int vfs_close(int fd)
+{
+  vfs_file_t *f = fd_slot(fd);
+  if (!f)
+  {
+    return -1;
+  }
+  memset(f, 0, sizeof(*f));
+  return 0;
+}
+
+int64_t vfs_pread(int fd, void *buf, size_t count, fs_off_t off)
+{
+  vfs_file_t *f = fd_get(fd);
+  if (!f || !(f->flags & FD_RD))
+  {
+    return -1;
+  }
+  return inode_pread(f->inode, buf, count, off);
+}
+
+int64_t vfs_pwrite(int fd, const void *buf, size_t count, fs_off_t off)
+{
+  vfs_file_t *f = fd_get(fd);
+  if (!f || !(f->flags & FD_WR))
+  {
+    return -1;
+  }
+  return inode_pwrite(f->inode, f->dent->d_parent, buf, count, off);
+}
+
+int64_t vfs_read(int fd, void *buf, size_t count)
+{
+  vfs_file_t *f = fd_get(fd);
+  int64_t n = f ? vfs_pread(fd, buf, count, f->pos) : -1;
+  if (n > 0)
+  {
+    f->pos += n;
+  }
+  return n;
+}
+
+int64_t vfs_write(int fd, const void *buf, size_t count)
+{
+  vfs_file_t *f = fd_get(fd);
+  if (f && (f->flags & FD_APPEND))
+  {
+    f->pos = (fs_off_t)f->inode->i_size;
+  }
+  int64_t n = f ? vfs_pwrite(fd, buf, count, f->pos) : -1;
+  if (n > 0)
+  {
+    f->pos += n;
+  }
+  return n;
+}
+
+fs_off_t vfs_lseek(int fd, fs_off_t off, int whence)
+{
+  vfs_file_t *f = fd_get(fd);
+  if (!f)
+  {
+    return -1;
+  }
+
+  fs_off_t base;
+  switch (whence)
+  {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = f->pos; break;
+    case SEEK_END: base = (fs_off_t)f->inode->i_size; break;
+    default:       return -1;
+  }
+  if ((off > 0 && base > INT64_MAX - off) || base + off < 0)
+  {
+    return -1;
+  }
+  f->pos = base + off;
+  return f->pos;
+}
+
+/* the file is gone: its fds fail from now on rather than touch it, and
+ * keep their number until closed */
+void vfs_fd_forget(const struct inode *inode)
+{
+  for (int fd = 0; fd < VFS_MAX_FDS; fd++)
+  {
+    if (fd_table[fd].open && fd_table[fd].inode == inode)
+    {
+      fd_table[fd].inode = NULL;
+      fd_table[fd].dent  = NULL;
+    }
+  }
+}
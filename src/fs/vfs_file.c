@@ -14,6 +14,8 @@
 #include "path.h"
 #include "block.h"
 #include "perm.h"
+#include "meta.h"
+#include "bmap.h"
 /* user define library done */
 
 /* user define function */
@@ -47,21 +49,19 @@ int vfs_cat(const char *path)
     {
       return -1;
     }
-    size_t remain = inode->i_size;
-    for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++)
+    uint8_t *buf = malloc(inode->i_size ? inode->i_size : 1);
+    if (!buf)
     {
-      int blk = inode->i_block[i];
-      if (blk < 0) break;
-
-      uint8_t buf[BLOCK_SIZE];
-      if (block_read(blk, buf) != 0)
-      {
-        return -1;
-      }
-      size_t n = (remain > BLOCK_SIZE) ? BLOCK_SIZE : remain;
-      fwrite(buf, 1, n, stdout);
-      remain -= n;
+      return -1;
     }
+    int64_t n = inode_read_data(inode, buf, inode->i_size);
+    if (n < 0)
+    {
+      free(buf);
+      return -1;
+    }
+    fwrite(buf, 1, (size_t)n, stdout);
+    free(buf);
     printf("\n");
     return 0;
 }
@@ -156,7 +156,7 @@ int vfs_create_file(const char *path)
   inode->i_size  = 0;
   inode->i_mtime = (uint64_t)time(NULL);
 
-  for (int i = 0; i < DIRECT_BLOCKS; i++)
+  for (int i = 0; i < N_BLOCKS; i++)
   {
     inode->i_block[i] = -1;
   }
@@ -185,6 +185,7 @@ int vfs_create_file(const char *path)
     free(inode);
     return -1;
   }
+  meta_mark_dirty();
   return 0;
 }
 
@@ -192,9 +193,6 @@ int vfs_write_all(const char *path, const char *data)
 {
     struct dentry *dent;
     struct inode  *inode;
-    size_t len;
-    size_t need_blocks;
-    size_t i, j;
 
     if (!path || !data)
     {
@@ -216,69 +214,15 @@ int vfs_write_all(const char *path, const char *data)
       return -1;
     }
 
-    len = strlen(data);
-
-
-    need_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (need_blocks > DIRECT_BLOCKS)
-    {
-      return -1;  /* file too large */
-    }
-
-    for (i = 0; i < DIRECT_BLOCKS; i++)
-    {
-      if (inode->i_block[i] >= 0) 
-      {
-        block_free(inode->i_block[i]);
-        inode->i_block[i] = -1;
-      }
-    }
-
-
-    for (i = 0; i < need_blocks; i++) 
-    {
-      int blk = block_alloc();
-      if (blk < 0) 
-      {
-          /* rollback */
-        for (j = 0; j < i; j++)
-        {
-          block_free(inode->i_block[j]);
-          inode->i_block[j] = -1;
-        }
-        return -1;
-      }
-
-      inode->i_block[i] = blk;
-
-      size_t offset = i * BLOCK_SIZE;
-      size_t remain = len - offset;
-      size_t write_size = remain > BLOCK_SIZE ? BLOCK_SIZE : remain;
-
-      uint8_t buf[BLOCK_SIZE];
-      memset(buf, 0, BLOCK_SIZE);
-      memcpy(buf, data + offset, write_size);
-
-
-      if (block_write(blk, buf) != 0) 
-      {
-        /* rollback */
-        for (j = 0; j <= i; j++)
-         {
-           if (inode->i_block[j] >= 0)
-           {
-             block_free(inode->i_block[j]);
-             inode->i_block[j] = -1;
-           }
-         }
-        return -1;
-      }
-    }
-
-    inode->i_size  = len;
-    inode->i_mtime = (uint64_t)time(NULL);
+    /* same path as import: contiguous runs, shared blocks under dedup */
+    return inode_write_bytes(inode, dent->d_parent, (const uint8_t *)data, strlen(data));
+}
 
-    return 0;
+static int count_block(int blkno, int is_map, void *arg)
+{
+  (void)blkno; (void)is_map;
+  (*(int *)arg)++;
+  return 0;
 }
 
 void vfs_stat(const char *path) {
@@ -296,10 +240,9 @@ void vfs_stat(const char *path) {
   node = dent->d_inode;
   if (!node) return;
 
+  /* data and indirect blocks alike */
   int block_count = 0;
-  for (int i = 0; i < DIRECT_BLOCKS; i++) {
-    if (node->i_block[i] >= 0) block_count++;
-  }
+  bmap_walk(node, count_block, &block_count);
 
   printf("  File: %s\n", path);
   printf("  Size: %zu \tBlocks: %d \tType: %s\n",
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vfs.h"
+#include "vfs_internal.h"
+#include "inode.h"
+#include "dentry.h"
+#include "block.h"
+#include "meta.h"
+#include "bmap.h"
+#include "perm.h"
+
+typedef struct
+{
+  size_t files;
+  size_t extents;
+  size_t fragmented;  /* files in more than one extent */
+  size_t moved;       /* defrag: files now in one extent */
+  size_t skipped;     /* defrag: shared blocks, no free run long enough or no write permission */
+} frag_stats_t;
+
+/* a file's data blocks in order, from its block map; NULL on error */
+static int *file_blocks(const struct inode *inode, int *n)
+{
+  size_t bs = block_size();
+  size_t want = (inode->i_size + bs - 1) / bs;
+  int *blks = (int *)malloc((want + 1) * sizeof(int));
+
+  *n = 0;
+  if (blks)
+  {
+    *n = (int)bmap_list(inode, blks, want);
+  }
+  return blks;
+}
+
+/* runs of consecutive block numbers in the block list */
+static int file_extents(const int *blks, int n)
+{
+  int ext = n > 0 ? 1 : 0;
+
+  for (int i = 1; i < n; i++)
+  {
+    if (blks[i] != blks[i - 1] + 1)
+    {
+      ext++;
+    }
+  }
+  return ext;
+}
+
+static void child_path(char out[256], const char *dir, const char *name)
+{
+  if (strcmp(dir, "/") == 0)
+  {
+    snprintf(out, 256, "/%s", name);
+  }
+  else
+  {
+    snprintf(out, 256, "%s/%s", dir, name);
+  }
+}
+
+/* move a file into one contiguous run: copy first, IO_CHUNK bytes at a
+ * time, then switch the block list in one step and free the old blocks,
+ * so the inode never points at a half copy and the journal commits the
+ * switch as a whole. only files the user may write are moved.
+ * 1 moved, 0 left as it is, -1 on error */
+static int defrag_file(struct inode *inode, const int *old, int n)
+{
+  if (n < 2 || file_extents(old, n) == 1 || fs_perm_check(inode, FS_W_OK) != 0)
+  {
+    return 0;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    /* moving a shared block would unshare it */
+    if (block_refcount(old[i]) > 1)
+    {
+      return 0;
+    }
+  }
+
+  int got;
+  int start = block_alloc_extent(old[0], n, &got);
+  if (start < 0)
+  {
+    return 0;
+  }
+  if (got < n)
+  {
+    block_free_extent(start, got); /* free space is no better */
+    return 0;
+  }
+
+  size_t bs = block_size();
+  int cb = IO_CHUNK / bs > 0 ? (int)(IO_CHUNK / bs) : 1;
+  if (cb > n)
+  {
+    cb = n;
+  }
+  int *blks = (int *)malloc((size_t)n * sizeof(int));
+  uint8_t *buf = (uint8_t *)malloc((size_t)cb * (bs + sizeof(block_iov_t)));
+  if (!blks || !buf)
+  {
+    free(blks);
+    free(buf);
+    block_free_extent(start, n);
+    return -1;
+  }
+
+  block_iov_t *iov = (block_iov_t *)(buf + (size_t)cb * bs);
+  for (int i = 0; i < cb; i++)
+  {
+    iov[i].base = buf + (size_t)i * bs;
+    iov[i].len  = bs;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    blks[i] = start + i;
+  }
+  for (int i = 0; i < n; i += cb)
+  {
+    int m = n - i < cb ? n - i : cb;
+    if (block_readv(old + i, iov, m) != 0 || block_writev(blks + i, iov, m) != 0)
+    {
+      free(buf);
+      free(blks);
+      block_free_extent(start, n);
+      return -1;
+    }
+  }
+  free(buf);
+
+  /* the new map gets indirect blocks of its own, built after the run;
+   * if it can't be had the old map and data still hold the file */
+  if (bmap_replace(inode, blks, (size_t)n) != 0)
+  {
+    free(blks);
+    block_free_extent(start, n);
+    return -1;
+  }
+  meta_mark_dirty();
+
+  for (int i = 0; i < n; i++)
+  {
+    block_free(old[i]);
+    block_dedup_index(blks[i]);
+  }
+  free(blks);
+  return 1;
+}
+
+/* every file under d; list prints the fragmented ones, defrag moves them */
+static int frag_walk(struct dentry *d, const char *path, frag_stats_t *st, int list, int defrag)
+{
+  struct inode *inode = d->d_inode;
+
+  if (!inode)
+  {
+    return 0;
+  }
+  if (inode->i_type == FS_INODE_FILE)
+  {
+    int n;
+    int *blks = file_blocks(inode, &n);
+    if (!blks)
+    {
+      return -1;
+    }
+    int ext = file_extents(blks, n);
+
+    if (defrag && ext > 1)
+    {
+      int rc = defrag_file(inode, blks, n);
+      if (rc < 0)
+      {
+        free(blks);
+        return -1;
+      }
+      if (rc > 0)
+      {
+        st->moved++;
+        ext = 1;
+      }
+      else
+      {
+        st->skipped++;
+      }
+    }
+    free(blks);
+
+    st->files++;
+    st->extents += (size_t)ext;
+    if (ext > 1)
+    {
+      st->fragmented++;
+      if (list)
+      {
+        printf("  %s: %d extents, %d blocks\n", path, ext, n);
+      }
+    }
+    return 0;
+  }
+
+  for (struct dentry *cur = d->d_child; cur != NULL; cur = cur->d_sibling)
+  {
+    char sub[256];
+
+    if (!cur->d_name || strcmp(cur->d_name, ".") == 0 || strcmp(cur->d_name, "..") == 0)
+    {
+      continue;
+    }
+    child_path(sub, path, cur->d_name);
+    if (frag_walk(cur, sub, st, list, defrag) != 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static struct dentry *frag_start(const char *path)
+{
+  if (!path || path[0] == '\0')
+  {
+    return vfs_lookup("/");
+  }
+  return vfs_lookup(path);
+}
+
+/* frag: free extents by size, then the files under path split in pieces */
+int vfs_frag(const char *path)
+{
+  struct dentry *start = frag_start(path);
+  if (!start || !start->d_inode)
+  {
+    printf("frag: %s: No such file or directory\n", path ? path : "");
+    return -1;
+  }
+
+  block_frag_t fr;
+  block_frag(&fr);
+  printf("free: %zu blocks in %zu extents, largest %zu\n",
+         block_free_blocks(), fr.runs, fr.largest);
+  for (int i = 0; i < BLOCK_FRAG_BUCKETS; i++)
+  {
+    if (fr.hist[i] == 0)
+    {
+      continue;
+    }
+    if (i == 0)
+    {
+      printf("  %6d blocks: %zu\n", 1, fr.hist[i]);
+    }
+    else if (i == BLOCK_FRAG_BUCKETS - 1)
+    {
+      printf("  %6zu+ blocks: %zu\n", (size_t)1 << i, fr.hist[i]);
+    }
+    else
+    {
+      printf("  %6zu-%zu blocks: %zu\n", (size_t)1 << i, ((size_t)2 << i) - 1, fr.hist[i]);
+    }
+  }
+
+  frag_stats_t st;
+  memset(&st, 0, sizeof(st));
+  frag_walk(start, path && path[0] ? path : "/", &st, 1, 0);
+  printf("files: %zu in %zu extents, %zu fragmented\n", st.files, st.extents, st.fragmented);
+  return 0;
+}
+
+/* defrag: each fragmented file under path into one contiguous run */
+int vfs_defrag(const char *path)
+{
+  struct dentry *start = frag_start(path);
+  if (!start || !start->d_inode)
+  {
+    printf("defrag: %s: No such file or directory\n", path ? path : "");
+    return -1;
+  }
+
+  frag_stats_t st;
+  memset(&st, 0, sizeof(st));
+  int rc = frag_walk(start, path && path[0] ? path : "/", &st, 0, 1);
+  printf("defrag: %zu files moved, %zu left fragmented\n", st.moved, st.skipped);
+  return rc;
+}
@@ -17,6 +17,15 @@ int  dentry_remove_child(struct dentry *parent, struct dentry *child);
 fs_uid_t fs_get_uid(void);     // get current user id
 void fs_set_uid(fs_uid_t uid);
 struct dentry *dentry_find_child(struct dentry *parent, const char *name);
+int64_t inode_read_data(const struct inode *inode, void *buf, size_t len); // bytes read, -1 on error
+int  inode_write_bytes(struct inode *inode, const struct dentry *dir,
+                       const uint8_t *data, size_t len); // replaces the contents, new files in dir's group
+int64_t inode_pread(const struct inode *inode, void *buf, size_t len, fs_off_t off); // bytes read, 0 at EOF, -1 on error
+int64_t inode_pwrite(struct inode *inode, const struct dentry *dir,
+                     const void *data, size_t len, fs_off_t off); // in place, grows the file; len or -1
+void vfs_fd_forget(const struct inode *inode); // rm: open fds on inode go stale
+
+#define IO_CHUNK (1u << 20) // bytes import, export and defrag move at a time
 
 
 #endif /* _VFS_INTERNAL_H_ */
@@ -1,8 +1,16 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE /* pread / pwrite / posix_fadvise */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 #include "vfs.h"
 #include "vfs_internal.h"
@@ -11,6 +19,8 @@
 #include "path.h"
 #include "block.h"
 #include "perm.h"
+#include "meta.h"
+#include "bmap.h"
 
 static const char *host_basename(const char *p)
 {
@@ -63,18 +73,119 @@ static int inode_free_blocks(struct inode *inode)
     return -1;
   }
 
-  for (int i = 0; i < DIRECT_BLOCKS; i++)
+  bmap_clear(inode, 1);
+  return 0;
+}
+
+/* allocation group of a directory: inode numbers aren't unique here, so
+ * it goes by the names on the way up to the root (root itself is 0) */
+static int dir_group(const struct dentry *dir)
+{
+  uint64_t h = 0;
+
+  for (const struct dentry *d = dir; d && d->d_parent && d->d_parent != d; d = d->d_parent)
   {
-    if (inode->i_block[i] >= 0)
+    h ^= 0xcbf29ce484222325ull; /* fnv-1a per name */
+    for (const char *c = d->d_name; c && *c; c++)
     {
-      block_free(inode->i_block[i]);
-      inode->i_block[i] = -1;
+      h = (h ^ (uint8_t)*c) * 0x100000001b3ull;
     }
   }
-  return 0;
+  return block_group_of(h);
 }
 
-static int inode_write_bytes(struct inode *inode, const uint8_t *data, size_t len)
+/* one iov per block of data[0..len), and the block already holding those
+ * bytes where dedup finds one (-1 where not); the number not found */
+static size_t chunk_dedup(const uint8_t *data, size_t len, block_iov_t *iov, int *blks)
+{
+  size_t bs = block_size();
+  size_t n = (len + bs - 1) / bs;
+  size_t fresh = 0;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    size_t off = i * bs;
+    size_t remain = len - off;
+
+    iov[i].base = (void *)(data + off);
+    iov[i].len  = remain > bs ? bs : remain;
+    blks[i] = block_dedup(iov[i].base, iov[i].len);
+    if (blks[i] < 0)
+    {
+      fresh++;
+    }
+  }
+  return fresh;
+}
+
+static void chunk_drop(const int *blks, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    if (blks[i] >= 0) block_free(blks[i]);
+  }
+}
+
+/* the blocks dedup didn't find, in as few contiguous runs as possible
+ * from *goal; wblk / wiov get them. how many, or -1 with every block of
+ * the chunk dropped */
+static int chunk_alloc(const block_iov_t *iov, int *blks, size_t n, int *goal,
+                       block_iov_t *wiov, int *wblk)
+{
+  int nw = 0;
+  for (size_t i = 0; i < n; )
+  {
+    if (blks[i] >= 0)
+    {
+      i++;
+      continue;
+    }
+
+    size_t gap = 1;
+    while (i + gap < n && blks[i + gap] < 0) gap++;
+
+    int run;
+    int start = block_alloc_extent(*goal, (int)gap, &run);
+    if (start < 0)
+    {
+      chunk_drop(blks, n);
+      return -1;
+    }
+
+    for (int k = 0; k < run; k++, i++)
+    {
+      blks[i] = start + k;
+      wblk[nw] = start + k;
+      wiov[nw++] = iov[i];
+    }
+    *goal = start + run;
+  }
+  return nw;
+}
+
+/* same, then written as one vectored write */
+static int chunk_store(const block_iov_t *iov, int *blks, size_t n, int *goal,
+                       block_iov_t *wiov, int *wblk)
+{
+  int nw = chunk_alloc(iov, blks, n, goal, wiov, wblk);
+  if (nw < 0)
+  {
+    return -1;
+  }
+  if (block_writev(wblk, wiov, nw) != 0)
+  {
+    chunk_drop(blks, n);
+    return -1;
+  }
+  return nw;
+}
+
+/* replace a file's contents; with dedup on, blocks whose bytes are
+ * already stored are shared and only the rest is allocated and written.
+ * a file without blocks yet starts in its directory's allocation group,
+ * one of INLINE_DATA_MAX bytes or less keeps them in its inode */
+int inode_write_bytes(struct inode *inode, const struct dentry *dir,
+                      const uint8_t *data, size_t len)
 {
   if (!inode || (!data && len > 0))
   {
@@ -86,156 +197,792 @@ static int inode_write_bytes(struct inode *inode, const uint8_t *data, size_t le
     return -1;
   }
 
-  size_t need_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  if (need_blocks > DIRECT_BLOCKS)
+  if (len > 0 && len <= INLINE_DATA_MAX)
+  {
+    inode_free_blocks(inode);
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    memcpy(inode->i_block, data, len);
+    inode->i_flags |= INODE_INLINE;
+    meta_mark_dirty();
+
+    inode->i_size = len;
+    inode->i_mtime = (uint64_t)time(NULL);
+    return 0;
+  }
+
+  size_t bs = block_size();
+  size_t need_blocks = (len + bs - 1) / bs;
+  if (need_blocks > bmap_max_blocks())
   {
     return -1;
   }
 
-  if (block_free_size() < need_blocks * (size_t)BLOCK_SIZE)
+  /* the file's block list and one iov per block, then the same for the
+   * blocks that get written */
+  block_iov_t *iov = (block_iov_t *)malloc((need_blocks + 1) * 2 * (sizeof(block_iov_t) + sizeof(int)));
+  if (!iov)
   {
     return -1;
   }
+  block_iov_t *wiov = iov + need_blocks;
+  int *blks = (int *)(wiov + need_blocks);
+  int *wblk = blks + need_blocks;
+  size_t fresh = chunk_dedup(data, len, iov, blks);
+
+  /* the indirect blocks of a long file come out of free space too */
+  if (block_free_size() < (fresh + bmap_map_blocks(need_blocks)) * bs)
+  {
+    chunk_drop(blks, need_blocks);
+    free(iov);
+    return -1;
+  }
+
+  /* rewrite near where the file lived before, else in the directory's group */
+  int goal = bmap_get(inode, 0);
+  if (goal < 0)
+  {
+    goal = block_group_goal(dir_group(dir));
+  }
 
   inode_free_blocks(inode);
+  meta_mark_dirty();
+
+  int nw = chunk_store(iov, blks, need_blocks, &goal, wiov, wblk);
+  if (nw < 0 || bmap_build(inode, blks, need_blocks) != 0)
+  {
+    free(iov);
+    return -1;
+  }
+  for (int i = 0; i < nw; i++)
+  {
+    block_dedup_index(wblk[i]);
+  }
+  free(iov);
+
+  inode->i_size = len;
+  inode->i_mtime = (uint64_t)time(NULL);
+
+  return 0;
+}
+
+/* the first len bytes of a file into buf as one vectored read */
+int64_t inode_read_data(const struct inode *inode, void *buf, size_t len)
+{
+  if (!inode || (!buf && len > 0))
+  {
+    return -1;
+  }
+
+  size_t bs = block_size();
+  size_t off = 0;
+
+  if (len > inode->i_size)
+  {
+    len = inode->i_size;
+  }
+  if (inode->i_flags & INODE_INLINE)
+  {
+    memcpy(buf, inode->i_block, len);
+    return (int64_t)len;
+  }
+  size_t want = (len + bs - 1) / bs;
+  block_iov_t *iov = (block_iov_t *)malloc((want + 1) * (sizeof(block_iov_t) + sizeof(int)));
+  if (!iov)
+  {
+    return -1;
+  }
+  int *blks = (int *)(iov + want);
+
+  /* the map resolves block by block, reading its indirect blocks once */
+  size_t cnt = bmap_list(inode, blks, want);
+  for (size_t i = 0; i < cnt; i++)
+  {
+    size_t n = len - off > bs ? bs : len - off;
+    iov[i].base = (uint8_t *)buf + off;
+    iov[i].len = n;
+    off += n;
+  }
+
+  int rc = block_readv(blks, iov, (int)cnt);
+  free(iov);
+  return rc != 0 ? -1 : (int64_t)off;
+}
+
+/* len bytes at off into buf, only the blocks they lie in; short at EOF */
+int64_t inode_pread(const struct inode *inode, void *buf, size_t len, fs_off_t off)
+{
+  if (!inode || off < 0 || (!buf && len > 0))
+  {
+    return -1;
+  }
+  if ((uint64_t)off >= inode->i_size)
+  {
+    return 0;
+  }
+  if (len > inode->i_size - (uint64_t)off)
+  {
+    len = inode->i_size - (uint64_t)off;
+  }
+  if (inode->i_flags & INODE_INLINE)
+  {
+    memcpy(buf, (const uint8_t *)inode->i_block + off, len);
+    return (int64_t)len;
+  }
 
-  for (size_t i = 0; i < need_blocks; i++)
+  size_t bs = block_size();
+  size_t done = 0;
+  while (done < len)
   {
-    int blk = block_alloc();
-    if (blk < 0)
+    uint64_t pos = (uint64_t)off + done;
+    size_t in = (size_t)(pos % bs);
+    size_t n = bs - in < len - done ? bs - in : len - done;
+
+    int blk = bmap_get(inode, (size_t)(pos / bs));
+    const uint8_t *p = blk < 0 ? NULL : (const uint8_t *)block_get(blk, BLOCK_RD);
+    if (!p)
     {
-      inode_free_blocks(inode);
       return -1;
     }
+    memcpy((uint8_t *)buf + done, p + in, n);
+    block_put(blk);
+    done += n;
+  }
+  return (int64_t)done;
+}
 
-    inode->i_block[i] = blk;
+/* blocks [have, want) onto the end of a file, right after its last one
+ * where there is room; the blocks already there and their map entries
+ * stay as they are. new blocks read as zeros without being written: the
+ * block layer zeroes them lazily */
+static int file_grow(struct inode *inode, const struct dentry *dir, size_t have, size_t want)
+{
+  size_t n = want - have;
 
-    size_t off = i * (size_t)BLOCK_SIZE;
-    size_t remain = len - off;
-    size_t wlen = remain > (size_t)BLOCK_SIZE ? (size_t)BLOCK_SIZE : remain;
+  if (block_free_blocks() < n + bmap_map_blocks(want) - bmap_map_blocks(have))
+  {
+    return -1;
+  }
+  int *blks = (int *)malloc(n * sizeof(int));
+  if (!blks)
+  {
+    return -1;
+  }
 
-    uint8_t buf[BLOCK_SIZE];
-    memset(buf, 0, sizeof(buf));
-    if (wlen > 0)
+  int goal = have > 0 ? bmap_get(inode, have - 1) + 1 : block_group_goal(dir_group(dir));
+  for (size_t i = 0; i < n; )
+  {
+    int run;
+    int start = block_alloc_extent(goal, (int)(n - i), &run);
+    if (start < 0)
     {
-      memcpy(buf, data + off, wlen);
+      while (i-- > 0) block_free(blks[i]);
+      free(blks);
+      return -1;
     }
+    for (int k = 0; k < run; k++, i++)
+    {
+      blks[i] = start + k;
+    }
+    goal = start + run;
+  }
+
+  meta_mark_dirty();
+  int rc = bmap_append(inode, have, blks, n);
+  if (rc != 0)
+  {
+    for (size_t i = 0; i < n; i++) block_free(blks[i]);
+  }
+  free(blks);
+  return rc;
+}
+
+/* blks[0..n) are file blocks first.. of a write covering bytes [from, to)
+ * of the first and last of them: those shared with a reflinked copy get
+ * blocks of their own, allocated in runs and mapped with one remap. only
+ * a block the write covers in part has its old bytes copied over; on
+ * success blks hold the blocks to write, on failure the map is as it was */
+static int file_unshare(struct inode *inode, size_t first, int *blks, size_t n,
+                        size_t from, size_t to)
+{
+  size_t bs = block_size();
+  size_t lo = n, hi = 0, shared = 0;
 
-    if (block_write(blk, buf) != 0)
+  for (size_t i = 0; i < n; i++)
+  {
+    if (block_refcount(blks[i]) > 1)
     {
-      inode_free_blocks(inode);
-      return -1;
+      lo = i < lo ? i : lo;
+      hi = i;
+      shared++;
     }
   }
+  if (shared == 0)
+  {
+    return 0;
+  }
 
-  inode->i_size = len;
-  inode->i_mtime = (uint64_t)time(NULL);
+  size_t span = hi - lo + 1;
+  int *nb = (int *)malloc(span * sizeof(int));
+  if (!nb)
+  {
+    return -1;
+  }
+  memcpy(nb, blks + lo, span * sizeof(int));
 
-  return 0;
+  /* the new blocks in runs, near the ones they replace */
+  size_t i = 0, done = 0;
+  int rc = 0;
+  while (done < shared)
+  {
+    int run;
+    while (block_refcount(nb[i]) <= 1) i++;
+    int start = block_alloc_extent(nb[i], (int)(shared - done), &run);
+    if (start < 0)
+    {
+      rc = -1;
+      break;
+    }
+    for (int k = 0; k < run; i++)
+    {
+      if (block_refcount(nb[i]) > 1)
+      {
+        nb[i] = start + k++;
+        done++;
+      }
+    }
+  }
+
+  for (size_t k = 0; k < span && rc == 0; k++)
+  {
+    size_t idx = lo + k;
+    int part = (idx == 0 && from > 0) || (idx == n - 1 && to < bs);
+    if (nb[k] == blks[idx] || !part)
+    {
+      continue;
+    }
+    const void *src = block_get(blks[idx], BLOCK_RD);
+    void *dst = src ? block_get(nb[k], BLOCK_NEW) : NULL;
+    if (dst)
+    {
+      memcpy(dst, src, bs);
+      block_put(nb[k]);
+    }
+    if (src)
+    {
+      block_put(blks[idx]);
+    }
+    rc = dst ? 0 : -1;
+  }
+
+  if (rc == 0)
+  {
+    rc = bmap_remap(inode, first + lo, nb, span);
+  }
+  for (size_t k = 0; k < span; k++)
+  {
+    if (nb[k] == blks[lo + k])
+    {
+      continue;
+    }
+    /* on success this drops the copy's reference to the old block */
+    block_free(rc == 0 ? blks[lo + k] : nb[k]);
+    blks[lo + k] = rc == 0 ? nb[k] : blks[lo + k];
+  }
+  if (rc == 0)
+  {
+    meta_mark_dirty();
+  }
+  free(nb);
+  return rc;
 }
 
-static int inode_read_to_file(const struct inode *inode, FILE *fp)
+static int64_t pwrite_blocks(struct inode *inode, const struct dentry *dir,
+                             const uint8_t *data, size_t len, uint64_t off)
 {
-  if (!inode || !fp)
+  size_t bs = block_size();
+  uint64_t end = off + len;
+  size_t have = (size_t)((inode->i_size + bs - 1) / bs);
+  size_t first = (size_t)(off / bs);
+  size_t last = (size_t)((end - 1) / bs);
+  size_t from = (size_t)(off % bs);
+  size_t to = (size_t)((end - 1) % bs) + 1;
+
+  if (last >= have)
+  {
+    if (file_grow(inode, dir, have, last + 1) != 0)
+    {
+      return -1;
+    }
+    /* the grown blocks are the file's from here on, zeros until written,
+     * so a failure below never leaves them mapped past EOF */
+    inode->i_size = (size_t)end;
+    meta_mark_dirty();
+  }
+
+  size_t n = last - first + 1;
+  int *blks = (int *)malloc(n * sizeof(int));
+  if (!blks)
+  {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    blks[i] = bmap_get(inode, first + i);
+    if (blks[i] < 0)
+    {
+      free(blks);
+      return -1;
+    }
+  }
+  /* blocks shared with a reflinked copy get copies of their own */
+  if (file_unshare(inode, first, blks, n, from, to) != 0)
   {
+    free(blks);
     return -1;
   }
 
-  if (fs_perm_check(inode, FS_R_OK) != 0)
+  for (size_t i = 0; i < n; i++)
+  {
+    size_t a = i == 0 ? from : 0;
+    size_t b = i == n - 1 ? to : bs;
+
+    uint8_t *p = (uint8_t *)block_get(blks[i], b - a == bs ? BLOCK_NEW : BLOCK_WR);
+    if (!p)
+    {
+      free(blks);
+      return -1;
+    }
+    memcpy(p + a, data + ((first + i) * bs + a - off), b - a);
+    block_put(blks[i]);
+    block_dedup_index(blks[i]);
+  }
+  free(blks);
+
+  if (end > inode->i_size)
+  {
+    inode->i_size = (size_t)end;
+    meta_mark_dirty();
+  }
+  inode->i_mtime = (uint64_t)time(NULL);
+  return (int64_t)len;
+}
+
+/* len bytes from data at off, in place: only the blocks the range covers
+ * are written, past EOF the file grows with zeros up to off. an inline
+ * file stays inline while it fits, else its bytes move to a block first */
+int64_t inode_pwrite(struct inode *inode, const struct dentry *dir,
+                     const void *data, size_t len, fs_off_t off)
+{
+  if (!inode || off < 0 || (!data && len > 0))
   {
     return -1;
   }
+  if (len == 0)
+  {
+    return 0;
+  }
 
-  size_t remain = inode->i_size;
+  size_t bs = block_size();
+  uint64_t end = (uint64_t)off + len;
+  if (end < (uint64_t)off || (end + bs - 1) / bs > bmap_max_blocks())
+  {
+    return -1;
+  }
 
-  for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++)
+  if (end <= INLINE_DATA_MAX && ((inode->i_flags & INODE_INLINE) || inode->i_size == 0))
   {
-    int blk = inode->i_block[i];
-    if (blk < 0)
+    if (!(inode->i_flags & INODE_INLINE))
     {
-      break;
+      memset(inode->i_block, 0, sizeof(inode->i_block));
+      inode->i_flags |= INODE_INLINE;
+    }
+    memcpy((uint8_t *)inode->i_block + off, data, len);
+    if (end > inode->i_size)
+    {
+      inode->i_size = (size_t)end;
     }
+    inode->i_mtime = (uint64_t)time(NULL);
+    meta_mark_dirty();
+    return (int64_t)len;
+  }
 
-    uint8_t buf[BLOCK_SIZE];
-    if (block_read(blk, buf) != 0)
+  if (inode->i_flags & INODE_INLINE)
+  {
+    uint8_t old[INLINE_DATA_MAX];
+    size_t n = inode->i_size;
+
+    memcpy(old, inode->i_block, n);
+    bmap_clear(inode, 0);
+    inode->i_size = 0;
+    meta_mark_dirty();
+    if (n > 0 && pwrite_blocks(inode, dir, old, n, 0) < 0)
     {
+      /* back the way it was, without whatever block it got */
+      bmap_clear(inode, 1);
+      memset(inode->i_block, 0, sizeof(inode->i_block));
+      memcpy(inode->i_block, old, n);
+      inode->i_flags |= INODE_INLINE;
+      inode->i_size = n;
       return -1;
     }
+  }
+  return pwrite_blocks(inode, dir, (const uint8_t *)data, len, (uint64_t)off);
+}
 
-    size_t n = remain > (size_t)BLOCK_SIZE ? (size_t)BLOCK_SIZE : remain;
-    if (n > 0)
+/* ---------- host files ----------
+ * import and export stream through two chunk buffers, so memory stays
+ * the same whatever the file size: IO_CHUNK bytes of whole blocks at a
+ * time, read with pread straight into the buffer the blocks are
+ * submitted from, and written back out from the buffer the blocks are
+ * submitted into. the device works on one chunk while the host file
+ * has the other */
+
+typedef struct
+{
+#ifndef _WIN32
+  int   fd;
+#else
+  FILE *fp;  /* unbuffered: each chunk is one read / write */
+#endif
+} host_file_t;
+
+/* open for reading (size set) or for writing, truncated */
+static int host_open(host_file_t *h, const char *path, int wr, uint64_t *size)
+{
+#ifndef _WIN32
+  h->fd = wr ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+  if (h->fd < 0)
+  {
+    return -1;
+  }
+  if (!wr)
+  {
+    struct stat st;
+    if (fstat(h->fd, &st) != 0 || st.st_size < 0)
     {
-      if (fwrite(buf, 1, n, fp) != n)
-      {
-        return -1;
-      }
+      close(h->fd);
+      return -1;
+    }
+    *size = (uint64_t)st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(h->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+  return 0;
+#else
+  h->fp = fopen(path, wr ? "wb" : "rb");
+  if (!h->fp)
+  {
+    return -1;
+  }
+  setvbuf(h->fp, NULL, _IONBF, 0);
+  if (!wr)
+  {
+    long long end = -1;
+    if (_fseeki64(h->fp, 0, SEEK_END) == 0)
+    {
+      end = _ftelli64(h->fp);
+    }
+    if (end < 0 || _fseeki64(h->fp, 0, SEEK_SET) != 0)
+    {
+      fclose(h->fp);
+      return -1;
     }
-    remain -= n;
+    *size = (uint64_t)end;
   }
+  return 0;
+#endif
+}
 
+/* all len bytes at off; windows goes in order, which is how they come */
+static int host_pread(host_file_t *h, void *buf, size_t len, uint64_t off)
+{
+#ifndef _WIN32
+  size_t done = 0;
+  while (done < len)
+  {
+    ssize_t n = pread(h->fd, (uint8_t *)buf + done, len - done, (off_t)(off + done));
+    if (n <= 0)
+    {
+      return -1;
+    }
+    done += (size_t)n;
+  }
   return 0;
+#else
+  (void)off;
+  return fread(buf, 1, len, h->fp) == len ? 0 : -1;
+#endif
 }
 
-int vfs_import(const char *host_path, const char *vfs_path)
+static int host_pwrite(host_file_t *h, const void *buf, size_t len, uint64_t off)
 {
-  if (!host_path || !vfs_path || host_path[0] == '\0' || vfs_path[0] == '\0')
+#ifndef _WIN32
+  size_t done = 0;
+  while (done < len)
   {
-    return -1;
+    ssize_t n = pwrite(h->fd, (const uint8_t *)buf + done, len - done, (off_t)(off + done));
+    if (n <= 0)
+    {
+      return -1;
+    }
+    done += (size_t)n;
   }
+  return 0;
+#else
+  (void)off;
+  return fwrite(buf, 1, len, h->fp) == len ? 0 : -1;
+#endif
+}
+
+static int host_close(host_file_t *h)
+{
+#ifndef _WIN32
+  return close(h->fd);
+#else
+  return fclose(h->fp);
+#endif
+}
+
+/* blocks per chunk, at least one */
+static size_t chunk_blocks(void)
+{
+  size_t bs = block_size();
+  return IO_CHUNK / bs > 0 ? IO_CHUNK / bs : 1;
+}
 
-  FILE *fp = fopen(host_path, "rb");
-  if (!fp)
+/* bytes of the chunk at off in a file of size */
+static size_t chunk_bytes(uint64_t off, uint64_t size)
+{
+  size_t max = chunk_blocks() * block_size();
+  return size - off < max ? (size_t)(size - off) : max;
+}
+
+/* replace a file's contents with size bytes of a host file, a chunk at
+ * a time: deduped, the rest allocated and written into a new block list
+ * that is switched in with bmap_replace at the end, as defrag does. a
+ * failure part way frees only the new blocks: the old contents stay */
+static int inode_import(struct inode *inode, const struct dentry *dir, host_file_t *h, uint64_t size)
+{
+  size_t bs = block_size();
+
+  if (size <= INLINE_DATA_MAX)
   {
-    return -1;
+    uint8_t small[INLINE_DATA_MAX];
+    if (host_pread(h, small, (size_t)size, 0) != 0)
+    {
+      return -1;
+    }
+    return inode_write_bytes(inode, dir, small, (size_t)size);
   }
 
-  if (fseek(fp, 0, SEEK_END) != 0)
+  size_t need = (size_t)((size + bs - 1) / bs);
+  if (need > bmap_max_blocks())
   {
-    fclose(fp);
     return -1;
   }
-
-  long fsz = ftell(fp);
-  if (fsz < 0)
+  /* the old blocks are held until the end: without dedup every block is
+   * a new one on top of them, fail before any is written */
+  if (!block_dedup_enabled() && block_free_blocks() < need + bmap_map_blocks(need))
   {
-    fclose(fp);
     return -1;
   }
 
-  if (fseek(fp, 0, SEEK_SET) != 0)
+  size_t cb = chunk_blocks();
+  size_t half = cb * bs;
+  size_t old_n = inode->i_flags & INODE_INLINE ? 0 : (size_t)((inode->i_size + bs - 1) / bs);
+  uint8_t *buf = (uint8_t *)malloc(2 * half + cb * 2 * sizeof(block_iov_t) +
+                                   (cb + need + old_n) * sizeof(int));
+  if (!buf)
   {
-    fclose(fp);
     return -1;
   }
+  block_iov_t *iov = (block_iov_t *)(buf + 2 * half);
+  block_iov_t *wiov = iov + cb;
+  int *wblk = (int *)(wiov + cb);
+  int *blks = wblk + cb; /* the new list, a chunk at a time */
+  int *old = blks + need;
+
+  int goal = bmap_get(inode, 0);
+  if (goal < 0)
+  {
+    goal = block_group_goal(dir_group(dir));
+  }
 
-  size_t len = (size_t)fsz;
-  size_t max_len = (size_t)DIRECT_BLOCKS * (size_t)BLOCK_SIZE;
+  block_submit_buffer(buf, 2 * half);
+  int rc = 0;
+  size_t have = 0;
+  for (uint64_t off = 0, k = 0; off < size && rc == 0; k++)
+  {
+    uint8_t *cur = buf + (size_t)(k & 1) * half;
+    size_t len = chunk_bytes(off, size);
+    size_t n = (len + bs - 1) / bs;
 
-  if (len > max_len)
+    if (host_pread(h, cur, len, off) != 0)
+    {
+      rc = -1;
+      break;
+    }
+    memset(cur + len, 0, n * bs - len); /* blocks are submitted whole */
+    /* the last chunk's writes went on meanwhile: done before its buffer is reused */
+    if (block_poll(1) != 0)
+    {
+      rc = -1;
+      break;
+    }
+    chunk_dedup(cur, len, iov, blks + have);
+    int nw = chunk_alloc(iov, blks + have, n, &goal, wiov, wblk);
+    if (nw < 0)
+    {
+      rc = -1;
+      break;
+    }
+    for (int i = 0; i < nw && rc == 0; i++)
+    {
+      if (block_submit_write(wblk[i], wiov[i].base) != 0)
+      {
+        rc = -1;
+      }
+    }
+    if (rc != 0 || block_poll(0) < 0)
+    {
+      block_poll(1);
+      chunk_drop(blks + have, n);
+      rc = -1;
+      break;
+    }
+    for (int i = 0; i < nw; i++)
+    {
+      block_dedup_index(wblk[i]);
+    }
+    have += n;
+    off += len;
+  }
+  if (block_poll(1) != 0)
+  {
+    rc = -1;
+  }
+  block_submit_buffer(NULL, 0);
+
+  /* the old blocks are listed before the map they are in goes */
+  if (rc == 0 && bmap_list(inode, old, old_n) != old_n)
   {
-    fclose(fp);
+    rc = -1;
+  }
+  if (rc == 0 && bmap_replace(inode, blks, need) != 0)
+  {
+    rc = -1;
+  }
+  if (rc != 0)
+  {
+    chunk_drop(blks, have);
+    free(buf);
     return -1;
   }
 
-  /* ---------- (3) read all bytes ---------- */
-  uint8_t *data = NULL;
-  if (len > 0)
+  chunk_drop(old, old_n);
+  free(buf);
+  inode->i_size = (size_t)size;
+  inode->i_mtime = (uint64_t)time(NULL);
+  meta_mark_dirty();
+  return 0;
+}
+
+/* queue the reads of the chunk at off into dst, whole blocks */
+static int chunk_submit_read(const struct inode *inode, uint64_t off, uint64_t size, uint8_t *dst)
+{
+  size_t bs = block_size();
+  size_t n = (chunk_bytes(off, size) + bs - 1) / bs;
+  size_t first = (size_t)(off / bs);
+
+  for (size_t i = 0; i < n; i++)
   {
-    data = (uint8_t*)malloc(len);
-    if (!data)
+    int b = bmap_get(inode, first + i);
+    if (b < 0 || block_submit_read(b, dst + i * bs) != 0)
     {
-      fclose(fp);
       return -1;
     }
+  }
+  return block_poll(0) < 0 ? -1 : 0;
+}
 
-    if (fread(data, 1, len, fp) != len)
+/* a file out to the host a chunk at a time: the reads of the next chunk
+ * are in flight while this one is written */
+static int inode_export(const struct inode *inode, host_file_t *h)
+{
+  size_t bs = block_size();
+  uint64_t size = inode->i_size;
+
+  if (size == 0)
+  {
+    return 0;
+  }
+  if (inode->i_flags & INODE_INLINE)
+  {
+    uint8_t small[INLINE_DATA_MAX];
+    int64_t n = inode_pread(inode, small, sizeof(small), 0);
+    return n < 0 || host_pwrite(h, small, (size_t)n, 0) != 0 ? -1 : 0;
+  }
+
+  size_t half = chunk_blocks() * bs;
+  uint8_t *buf = (uint8_t *)malloc(2 * half);
+  if (!buf)
+  {
+    return -1;
+  }
+  block_submit_buffer(buf, 2 * half);
+
+  int rc = chunk_submit_read(inode, 0, size, buf);
+  for (uint64_t off = 0, k = 0; off < size && rc == 0; k++)
+  {
+    uint8_t *cur = buf + (size_t)(k & 1) * half;
+    size_t len = chunk_bytes(off, size);
+
+    if (block_poll(1) != 0)
     {
-      free(data);
-      fclose(fp);
-      return -1;
+      rc = -1;
+      break;
+    }
+    if (off + len < size)
+    {
+      rc = chunk_submit_read(inode, off + len, size, buf + (size_t)((k + 1) & 1) * half);
+    }
+    if (host_pwrite(h, cur, len, off) != 0)
+    {
+      rc = -1;
     }
+    off += len;
+  }
+  if (block_poll(1) != 0)
+  {
+    rc = -1;
+  }
+  block_submit_buffer(NULL, 0);
+  free(buf);
+  return rc;
+}
+
+int vfs_import(const char *host_path, const char *vfs_path)
+{
+  if (!host_path || !vfs_path || host_path[0] == '\0' || vfs_path[0] == '\0')
+  {
+    return -1;
+  }
+
+  host_file_t h;
+  uint64_t len;
+  if (host_open(&h, host_path, 0, &len) != 0)
+  {
+    return -1;
+  }
+
+  uint64_t max_len = (uint64_t)bmap_max_blocks() * block_size();
+
+  if (len > max_len)
+  {
+    host_close(&h);
+    return -1;
   }
-  fclose(fp);
 
   char target[256];
   strncpy(target, vfs_path, sizeof(target) - 1);
@@ -247,8 +994,7 @@ int vfs_import(const char *host_path, const char *vfs_path)
 
   if (target[0] == '\0')
   {
-    if (data)
-      free(data);
+    host_close(&h);
     return -1;
   }
 
@@ -280,24 +1026,21 @@ int vfs_import(const char *host_path, const char *vfs_path)
   {
     if (vfs_create_file(target) != 0)
     {
-      if (data)
-        free(data);
+      host_close(&h);
       return -1;
     }
 
     dent = vfs_lookup(target);
     if (!dent || !dent->d_inode)
     {
-      if (data)
-        free(data);
+      host_close(&h);
       return -1;
     }
   }
 
   if (!dent->d_inode || dent->d_inode->i_type != FS_INODE_FILE)
   {
-    if (data)
-      free(data);
+    host_close(&h);
     return -1;
   }
 
@@ -309,10 +1052,10 @@ int vfs_import(const char *host_path, const char *vfs_path)
   }
   else
   {
-    rc = inode_write_bytes(dent->d_inode, data, len);
+    rc = inode_import(dent->d_inode, dent->d_parent, &h, len);
   }
 
-  if (data) free(data);
+  host_close(&h);
   return rc;
 }
 
@@ -339,15 +1082,18 @@ int vfs_export(const char *vfs_path, const char *host_path)
     return -1;
   }
 
-  FILE *fp = fopen(host_path, "wb");
-  if (!fp)
+  host_file_t h;
+  if (host_open(&h, host_path, 1, NULL) != 0)
   {
     return -1;
   }
 
-  int rc = inode_read_to_file(dent->d_inode, fp);
+  int rc = inode_export(dent->d_inode, &h);
 
-  fclose(fp);
+  if (host_close(&h) != 0)
+  {
+    rc = -1;
+  }
   return rc;
 }
 
@@ -368,35 +1114,25 @@ int vfs_cp(const char *src_path, const char *dest_path) {
     return -1;
   }
 
+  size_t bs = block_size();
   size_t len = src->d_inode->i_size;
-  size_t max_len = (size_t)DIRECT_BLOCKS * (size_t)BLOCK_SIZE;
+  size_t max_len = bmap_max_blocks() * bs;
   if (len > max_len)
     return -1;
 
   uint8_t *buf = NULL;
   if (len > 0) {
-    buf = malloc(len);
+    buf = malloc(len + 1);
     if (!buf)
       return -1;
+    buf[len] = '\0';
 
-    size_t remain = len;
-    size_t off = 0;
-    for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++) {
-      int blk = src->d_inode->i_block[i];
-      if (blk < 0)
-        break;
-
-      uint8_t tmp[BLOCK_SIZE];
-      if (block_read(blk, tmp) != 0) {
-        free(buf);
-        return -1;
-      }
-
-      size_t n = remain > (size_t)BLOCK_SIZE ? (size_t)BLOCK_SIZE : remain;
-      memcpy(buf + off, tmp, n);
-      off += n;
-      remain -= n;
+    int64_t n = inode_read_data(src->d_inode, buf, len);
+    if (n < 0) {
+      free(buf);
+      return -1;
     }
+    buf[n] = '\0';
   }
 
   struct dentry *dest = vfs_lookup(dest_path);
@@ -426,15 +1162,83 @@ int vfs_cp(const char *src_path, const char *dest_path) {
     return -1;
   }
 
-  int rc = 0;
-  if (len == 0) {
-    rc = vfs_write_all(dest_path, "");
-  }
-  else {
-    rc = vfs_write_all(dest_path, (const char *)buf);
-  }
+  /* byte for byte, a binary file has NULs in it */
+  int rc = inode_write_bytes(dest->d_inode, dest->d_parent, buf, len);
 
   if (buf)
     free(buf);
   return rc;
 }
+
+/* cp --reflink: dest gets the source's blocks, shared; whichever file is
+ * written later gets fresh blocks of its own */
+int vfs_cp_reflink(const char *src_path, const char *dest_path) {
+  struct dentry *src = vfs_lookup(src_path);
+  if (!src || !src->d_inode) {
+    printf("cp: cannot stat '%s': No such file\n", src_path);
+    return -1;
+  }
+  if (src->d_inode->i_type != FS_INODE_FILE) {
+    printf("cp: '%s' is not a regular file\n", src_path);
+    return -1;
+  }
+  if (fs_perm_check(src->d_inode, FS_R_OK) != 0) {
+    return -1;
+  }
+
+  struct dentry *dest = vfs_lookup(dest_path);
+  if (!dest) {
+    if (vfs_create_file(dest_path) != 0)
+      return -1;
+    dest = vfs_lookup(dest_path);
+    if (!dest || !dest->d_inode)
+      return -1;
+  }
+  if (dest->d_inode->i_type != FS_INODE_FILE) {
+    return -1;
+  }
+  if (fs_perm_check(dest->d_inode, FS_W_OK) != 0) {
+    return -1;
+  }
+  if (dest->d_inode == src->d_inode) {
+    return 0;
+  }
+
+  struct inode *s = src->d_inode;
+  struct inode *d = dest->d_inode;
+
+  /* the data blocks are shared, the indirect ones each file has its own */
+  size_t bs = block_size();
+  size_t n = (s->i_size + bs - 1) / bs;
+  int *blks = (int *)malloc((n + 1) * sizeof(int));
+  if (!blks) {
+    return -1;
+  }
+  n = bmap_list(s, blks, n);
+
+  for (size_t i = 0; i < n; i++) {
+    if (block_ref(blks[i]) != 0) {
+      while (i-- > 0)
+        block_free(blks[i]);
+      free(blks);
+      return -1;
+    }
+  }
+
+  inode_free_blocks(d);
+  int rc = bmap_build(d, blks, n);
+  free(blks);
+  if (rc != 0) {
+    meta_mark_dirty();
+    return -1;
+  }
+  if (s->i_flags & INODE_INLINE) {
+    /* nothing to share, the bytes are in the inode */
+    memcpy(d->i_block, s->i_block, sizeof(d->i_block));
+    d->i_flags |= INODE_INLINE;
+  }
+  d->i_size = s->i_size;
+  d->i_mtime = (uint64_t)time(NULL);
+  meta_mark_dirty();
+  return 0;
+}
@@ -47,43 +47,12 @@ static int vfs_read_all_into_buf(const char *path, char *out, size_t out_sz)
     return -1;
   }
 
-  size_t remain = inode->i_size;
-  size_t pos = 0;
-
-  for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++)
+  int64_t n = inode_read_data(inode, out, out_sz - 1);
+  if (n < 0)
   {
-    int blk = inode->i_block[i];
-    if (blk < 0)
-    {
-      break;
-    }
-
-    uint8_t b[BLOCK_SIZE];
-    if (block_read(blk, b) != 0)
-    {
-      return -1;
-    }
-
-    size_t n = (remain > BLOCK_SIZE) ? BLOCK_SIZE : remain;
-
-    if (pos + n >= out_sz)
-    {
-      n = (out_sz - 1) - pos;
-    }
-
-    memcpy(out + pos, b, n);
-    pos += n;
-    out[pos] = '\0';
-
-    remain -= n;
-
-    if (pos >= out_sz - 1)
-    {
-      break;
-    }
+    return -1;
   }
-
-  out[out_sz - 1] = '\0';
+  out[n] = '\0';
   return 0;
 }
 
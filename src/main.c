@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vfs.h"
 #include "meta.h"
@@ -6,13 +8,80 @@
 #include "block.h"
 
 
-int main(void)
+static void usage(const char *prog)
 {
-    block_init();
+    printf("usage: %s [-b block_size] [-n block_count] [-c cache_blocks] [-z] [-d] [image]\n", prog);
+    printf("  -b/-n only apply when a new image is formatted (default %d x %d)\n",
+           BLOCK_SIZE_DEFAULT, BLOCK_COUNT_DEFAULT);
+    printf("  -c reads the image through a cache of that many blocks (min %d)\n"
+           "     instead of mapping it, for images larger than memory\n",
+           BLOCK_CACHE_MIN);
+    printf("  -z stores data blocks LZ-compressed, read back through the cache\n"
+           "     (%d blocks unless -c says otherwise); only saves space with\n"
+           "     blocks larger than a 4096 byte page, smaller ones stay raw\n",
+           BLOCK_CACHE_COMPRESS);
+    printf("  -d shares file blocks with identical contents (dedup)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = "disk.img";
+    unsigned long long bsize = BLOCK_SIZE_DEFAULT;
+    unsigned long long count = BLOCK_COUNT_DEFAULT;
+    int compress = 0;
 
-    if (block_load_image("disk.img") != 0)
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            bsize = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            count = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            block_set_cache((size_t)strtoull(argv[++i], NULL, 0));
+        }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            compress = 1;
+            block_set_compress(1);
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            block_set_dedup(1);
+        }
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            image = argv[i];
+        }
+    }
+
+    if (block_load_image(image) != 0)
     {
         printf("first run, empty disk\n");
+        if (block_format((size_t)bsize, (uint64_t)count) != 0)
+        {
+            printf("bad geometry: %llu x %llu\n", bsize, count);
+            return 1;
+        }
+        /* create the (sparse) image now so sync has somewhere to go */
+        if (block_save_image(image) != 0)
+        {
+            printf("cannot create %s, changes stay in memory\n", image);
+        }
+    }
+
+    if (compress && !block_compress_enabled())
+    {
+        printf("-z: %zu byte blocks can't shrink below a page, stored raw\n", block_size());
     }
 
     fs_init();
@@ -21,5 +90,5 @@ int main(void)
     run_shell();
 
     meta_save();
-    block_save_image("disk.img");
+    block_save_image(image);
 }
@@ -1,7 +1,14 @@
 /* standard library */
+#ifndef _WIN32
+#define _DEFAULT_SOURCE /* poll */
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
 /* standard library done */
 
 /* user define */
@@ -10,6 +17,7 @@
 #include "fs/path.h"
 #include "fs/perm.h"
 #include "fs/block.h" 
+#include "fs/lz.h"
 /* user define done */
 
 /* marco */
@@ -26,6 +34,7 @@
 
 /* define function */
 static void print_help(void);
+static void wait_input_or_commit(void);
 void run_shell(void);
 /* define function done*/
 
@@ -40,6 +49,11 @@ static void print_help(void)
   printf("  help                         - Show this help message\n");
   printf("  exit                         - Exit the shell\n");
   printf("  df                           - Show disk usage information\n");
+  printf("  sync                         - Save changes to the disk image now\n");
+  printf("  scrub                        - Verify every used block against its checksum\n");
+  printf("  groups                       - Show the allocation groups and their free blocks\n");
+  printf("  frag [path]                  - Show free space and file fragmentation\n");
+  printf("  defrag [path]                - Move fragmented files into contiguous blocks\n");
   printf("  id                           - Show current user identity\n");
   printf("  sudo <cmd>                   - Execute command as superuser\n");
   printf("  ls [path]                    - List files in a directory\n");
@@ -50,13 +64,17 @@ static void print_help(void)
   printf("  touch <path>                 - Create an empty file\n");
   printf("  stat <path>                  - Show file or directory status\n");
   printf("  cp <src> <dest>              - Copy file from source to destination\n");
+  printf("  cp --reflink <src> <dest>    - Copy by sharing blocks (copy on write)\n");
   printf("  write <path> <text>          - Write text to a file (overwrite)\n");
+  printf("  write -o <off> <path> <text> - Write text at a byte offset, in place\n");
+  printf("  write -a <path> <text>       - Append text to a file\n");
   printf("  vim <path> <text>            - Edit file content (simple editor)\n");
   printf("  cat <path>                   - Display file contents\n");
   printf("  rm <path>                    - Remove a file\n");
   printf("  chmod <mode(octal)> <path>   - Change file permissions\n");
   printf("  import <host_path> <vfs_path>- Import file from host to VFS\n");
   printf("  export <vfs_path> <host_path>- Export file from VFS to host\n");
+  printf("  lzbench <host_path>          - Block compression speed on a host file\n");
 
   printf("\nExamples:\n");
   printf("  mkdir a                      - Create directory 'a'\n");
@@ -67,6 +85,33 @@ static void print_help(void)
   printf("  sudo rmdir a                 - Remove directory 'a' as superuser\n");
 }
 
+/* group commit: while the batch is young, wait for the next command;
+ * if none comes before it is due, journal it now */
+static void wait_input_or_commit(void)
+{
+  int ms = vfs_commit_due_in();
+
+  if (ms < 0)
+  {
+    return;
+  }
+#ifndef _WIN32
+  if (ms > 0)
+  {
+    struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    fflush(stdout);
+    if (poll(&p, 1, ms) > 0)
+    {
+      return;  /* more input, keep batching */
+    }
+  }
+#endif
+  if (vfs_commit() != 0)
+  {
+    printf("journal commit failed\n");
+  }
+}
+
 void run_shell(void)
 { 
   int is_sudo=0;
@@ -74,6 +119,10 @@ void run_shell(void)
   fs_gid_t old_gid = fs_get_gid();
 
   char buf[CMD_BUF];
+#ifndef _WIN32
+  /* poll() must see every unread line, so nothing may sit in stdio's buffer */
+  setvbuf(stdin, NULL, _IONBF, 0);
+#endif
   printf("Total=%zu Used=%zu Free=%zu\n", block_total_size(), block_used_size(), block_free_size());
   while (1)
   {
@@ -93,6 +142,7 @@ void run_shell(void)
        cwd,
        prompt_char);
 
+    wait_input_or_commit();
     if (!fgets(buf, sizeof(buf), stdin))
     {
       continue;
@@ -239,7 +289,68 @@ void run_shell(void)
     /* df */
     if (strcmp(buf, "df")==0)
     {
-      printf("Total=%zu Used=%zu Free=%zu\n", block_total_size(), block_used_size(), block_free_size());
+      printf("Total=%zu Used=%zu Free=%zu", block_total_size(), block_used_size(), block_free_size());
+      if (block_dedup_enabled())
+      {
+        /* file bytes held per byte stored, shared blocks counted per owner */
+        size_t used = block_used_blocks();
+        double ratio = used ? (double)(used + block_shared_blocks()) / (double)used : 1.0;
+        printf(" Dedup=%.2fx", ratio);
+      }
+      if (block_image_size())
+      {
+        /* host space behind the image: freed blocks are punched out of it */
+        printf(" Image=%zu", block_image_size());
+      }
+      printf("\n");
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+    /* sync */
+    if (strcmp(buf, "sync") == 0)
+    {
+      if (vfs_sync() == 0)
+      {
+        printf("sync ok\n");
+      }
+      else
+      {
+        printf("sync failed\n");
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+    /* groups */
+    if (strcmp(buf, "groups") == 0)
+    {
+      block_group_t g;
+      for (int i = 0; block_group_info(i, &g) == 0; i++)
+      {
+        printf("group %d: blocks %d-%d, %d free\n", i, g.first, g.first + g.blocks - 1, g.free);
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+    /* scrub */
+    if (strcmp(buf, "scrub") == 0)
+    {
+      block_scrub_t r;
+      if (block_scrub(&r) != 0)
+      {
+        printf("scrub: image has no checksums (or was never saved)\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      printf("scrub: %zu blocks checked, %d threads, %zu bad\n", r.checked, r.threads, r.bad);
+      size_t shown = r.bad < 16 ? r.bad : 16;
+      for (size_t i = 0; i < shown; i++)
+      {
+        printf("  bad block %d\n", r.bad_blocks[i]);
+      }
+      if (block_csum_errors())
+      {
+        printf("  (%zu checksum errors on reads since mount)\n", block_csum_errors());
+      }
       SUDO_RESTORE(is_sudo, old_uid, old_gid);
       continue;
     }
@@ -349,6 +460,34 @@ void run_shell(void)
       continue;
     }
 
+    /* frag [path] / defrag [path] */
+    if (strncmp(buf, "frag", 4) == 0 || strncmp(buf, "defrag", 6) == 0)
+    {
+      int defrag = buf[0] == 'd';
+      const char *arg = buf + (defrag ? 6 : 4);
+
+      if (*arg == '\0' || *arg == ' ' || *arg == '\t')
+      {
+        char pathbuf[256];
+        while (*arg == ' ' || *arg == '\t') arg++;
+        strncpy(pathbuf, arg, sizeof(pathbuf) - 1);
+        pathbuf[sizeof(pathbuf) - 1] = '\0';
+        trim(pathbuf);
+        remove_multiple_slashes(pathbuf);
+        rstrip_slash(pathbuf);
+        if (defrag)
+        {
+          vfs_defrag(pathbuf);
+        }
+        else
+        {
+          vfs_frag(pathbuf);
+        }
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+    }
+
     /* tree [path] */
     if (strncmp(buf, "tree", 4) == 0)
     {
@@ -397,7 +536,13 @@ void run_shell(void)
     if (strncmp(buf, "cp ", 3) == 0)
     {
       char *arg = buf + 3;
+      int reflink = 0;
       while (*arg == ' ' || *arg == '\t') arg++;
+      if (strncmp(arg, "--reflink", 9) == 0 && (arg[9] == ' ' || arg[9] == '\t')) {
+        reflink = 1;
+        arg += 9;
+        while (*arg == ' ' || *arg == '\t') arg++;
+      }
       char *src = arg;
       while (*arg && *arg != ' ' && *arg != '\t') arg++;
 
@@ -412,26 +557,70 @@ void run_shell(void)
       if (*src == '\0' || *dest == '\0') {
         printf("cp: source and destination required\n");
       } else {
-        if (vfs_cp(src, dest) == 0) printf("cp ok\n");
+        int rc = reflink ? vfs_cp_reflink(src, dest) : vfs_cp(src, dest);
+        if (rc == 0) printf("cp ok\n");
         else printf("cp failed\n");
       }
       SUDO_RESTORE(is_sudo, old_uid, old_gid);
       continue;
     }
 
-    /* write <path> <text...> */
+    /* write [-o <offset> | -a] <path> <text...> */
     if (strncmp(buf, "write ", 6) == 0)
     {
       char *arg  = buf + 6;
       char pathbuf[256];
       char *path;
       char *data;
+      long long off = -1;  /* -1: replace the whole file */
+      int append = 0;
 
       while (*arg == ' ' || *arg == '\t')
       {
         arg++;
       }
 
+      /* options in any order before the path; -a and -o don't mix */
+      int bad = 0;
+      while (arg[0] == '-' && (arg[1] == 'a' || arg[1] == 'o') &&
+             (arg[2] == ' ' || arg[2] == '\t'))
+      {
+        if (arg[1] == 'a')
+        {
+          append = 1;
+          arg += 2;
+        }
+        else
+        {
+          char *end;
+
+          arg += 2;
+          off = strtoll(arg, &end, 0);
+          if (end == arg || off < 0)
+          {
+            printf("write: offset required\n");
+            bad = 1;
+            break;
+          }
+          arg = end;
+        }
+        while (*arg == ' ' || *arg == '\t')
+        {
+          arg++;
+        }
+      }
+      if (!bad && append && off >= 0)
+      {
+        printf("write: -a and -o can't be used together\n");
+        printf("usage: write [-o <offset> | -a] <path> <text>\n");
+        bad = 1;
+      }
+      if (bad)
+      {
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+
       if (*arg == '\0')
       {
         printf("write: path required\n");
@@ -472,7 +661,35 @@ void run_shell(void)
       remove_multiple_slashes(pathbuf);
       rstrip_slash(pathbuf);
 
-      if (vfs_write_all(pathbuf, data) == 0)
+      int rc;
+      if (append)
+      {
+        /* the tail block is filled in place, new blocks only past it */
+        size_t len = strlen(data);
+        int fd = vfs_open(pathbuf, "a");
+        rc = fd < 0 || vfs_write(fd, data, len) != (int64_t)len ? -1 : 0;
+        if (fd >= 0)
+        {
+          vfs_close(fd);
+        }
+      }
+      else if (off >= 0)
+      {
+        /* only the blocks under [off, off + len) are touched */
+        size_t len = strlen(data);
+        int fd = vfs_open(pathbuf, "r+");
+        rc = fd < 0 || vfs_pwrite(fd, data, len, (fs_off_t)off) != (int64_t)len ? -1 : 0;
+        if (fd >= 0)
+        {
+          vfs_close(fd);
+        }
+      }
+      else
+      {
+        rc = vfs_write_all(pathbuf, data);
+      }
+
+      if (rc == 0)
       {
         printf("write ok: %s\n", pathbuf);
       }
@@ -704,6 +921,48 @@ void run_shell(void)
       continue;
     }
 
+    /* lzbench <host_path>: the codec of block compression, in block sized pieces */
+    if (strncmp(buf, "lzbench ", 8) == 0)
+    {
+      char *host = buf + 8;
+      while (*host == ' ' || *host == '\t') host++;
+      trim(host);
+
+      FILE *fp = fopen(host, "rb");
+      if (!fp)
+      {
+        printf("lzbench: cannot open %s\n", host);
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+
+      size_t cap = 1u << 20, len = 0, n;
+      uint8_t *data = (uint8_t *)malloc(cap);
+      while (data && (n = fread(data + len, 1, cap - len, fp)) > 0)
+      {
+        len += n;
+        if (len == cap)
+        {
+          uint8_t *grown = (uint8_t *)realloc(data, cap * 2);
+          if (!grown) break;
+          data = grown;
+          cap *= 2;
+        }
+      }
+      fclose(fp);
+
+      if (!data)
+      {
+        printf("lzbench: out of memory\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      lz_bench(data, len, block_size());
+      free(data);
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+
 
     /* vim <path> */
     if (strncmp(buf, "vim ", 4) == 0)